@@ -12,234 +12,1727 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <dlfcn.h> /* header required for dlsym() */
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <pango/pango.h>
-#include <GL/glx.h>
 #include <gtk/gtk.h>
 
+/****************************************************************************
+ Hook profiles
+ The Makefile builds variants of the library for each tool, they include just
+ the wrappers the tool needs (see check_interposer). All by default.
+ HOOK_GLX   OpenGL frames, render settle and capture (3D viewer)
+ HOOK_PRINT GTK print dialog (pcbnew export)
+ HOOK_LABEL Button and label texts, remapped to add accelerators (dialogs)
+ HOOK_IO    Files opened, closed and renamed (outputs created)
+ HOOK_DLOPEN Libraries loaded (start-up profile), off by default: dlopen is
+            called from our library, so the RUNPATH of the caller is lost
+ The library is built using -fvisibility=hidden, only the wrappers marked as
+ INTERPOSED are exported.
+****************************************************************************/
+#ifndef HOOK_GLX
+ #define HOOK_GLX 1
+#endif
+#ifndef HOOK_PRINT
+ #define HOOK_PRINT 1
+#endif
+#ifndef HOOK_LABEL
+ #define HOOK_LABEL 1
+#endif
+#ifndef HOOK_IO
+ #define HOOK_IO 1
+#endif
+#ifndef HOOK_DLOPEN
+ #define HOOK_DLOPEN 0
+#endif
+#define INTERPOSED __attribute__((visibility("default")))
+#if HOOK_GLX
+ #include <GL/glx.h>
+#endif
+
 /* Always log open/close activity, not just when requested */
 #define FORCE_LOW_LEVEL_LOG 1
 /* Log even when opening for read */
 #define ALL_OPEN_MODES 1
 
-void glXSwapBuffers(Display *dpy, GLXDrawable drawable)
+/****************************************************************************
+ Events
+ All the messages are events with a kind, an optional text and an optional
+ integer argument. By default they are printed to stdout, one per line.
+ When KIAUTO_INTERPOSER_RING points to a ring file created by KiAuto they
+ are stored in shared memory instead, avoiding stdio locks and flushes.
+ Keep the kinds and the layout in sync with kiauto/interposer_ring.py
+****************************************************************************/
+
+enum
+{
+ EV_INFO, EV_GLX_SWAP, EV_PANGO, EV_WIN_TITLE, EV_WIN_MODAL, EV_WIN_SHOW, EV_BUTTON_LABEL,
+ EV_BUTTON_CHANGED, EV_ERROR, EV_READ, EV_PRINT_RUN, EV_LABEL_TEXT, EV_FILENAME, EV_FILENAME_CHANGED,
+ EV_IO_OPEN, EV_IO_FOPEN64, EV_IO_FOPEN, EV_IO_OPEN64_MODE, EV_IO_OPEN_MODE, EV_IO_CLOSE, EV_MAIN_IN,
+ EV_MAIN_OUT, EV_WIN_DESTROY, EV_IO_OPENAT_MODE, EV_IO_OPENAT64_MODE, EV_MAIN_IDLE, EV_MAIN_BUSY,
+ EV_GLX_SETTLED, EV_DIALOG_AUTO, EV_IO_COMPLETE, EV_GLX_CAPTURED, EV_PROGRESS, EV_PROGRESS_END
+};
+
+/* How the text and the argument are added to the prefix */
+enum { EVF_NONE, EVF_STR, EVF_INT, EVF_STR_INT, EVF_HEX };
+
+static const struct
+{
+ const char *prefix;
+ int format;
+} ev_desc[]=
+{
+ { "* ", EVF_STR },
+ { "GLX:Swap ", EVF_STR },
+ { "PANGO:", EVF_STR },
+ { "GTK:Window Title:", EVF_STR },
+ { "GTK:Window Set Modal:", EVF_STR_INT },
+ { "GTK:Window Show:", EVF_STR },
+ { "GTK:Button Label:", EVF_STR },
+ { "GTK:Button Label:**Changed from ", EVF_STR },
+ { "GTK:Error:", EVF_STR },
+ { "GTK:Read:", EVF_STR },
+ { "GTK:Print Run:", EVF_STR },
+ { "GTK:Label Set Text 2:", EVF_STR },
+ { "GTK:Filename:", EVF_STR },
+ { "GTK:Filename:**Changed from ", EVF_STR },
+ { "IO:open:", EVF_STR },
+ { "IO:fopen64:", EVF_STR },
+ { "IO:fopen:", EVF_STR },
+ { "IO:open64:", EVF_HEX },
+ { "IO:open:", EVF_HEX },
+ { "IO:close:", EVF_STR },
+ { "GTK:Main:In", EVF_NONE },
+ { "GTK:Main:Out", EVF_NONE },
+ { "GTK:Window Destroy:", EVF_STR },
+ { "IO:openat:", EVF_HEX },
+ { "IO:openat64:", EVF_HEX },
+ { "GTK:Main:Idle", EVF_NONE },
+ { "GTK:Main:Busy", EVF_NONE },
+ { "GLX:Settled ", EVF_INT },
+ { "GTK:Dialog Auto:", EVF_STR },
+ { "IO:Complete:", EVF_STR_INT },
+ { "GLX:Captured:", EVF_STR_INT },
+ { "GTK:Progress:", EVF_STR_INT },
+ { "GTK:Progress End:", EVF_STR }
+};
+
+#define RING_MAGIC   0x4B495247  /* KIRG */
+#define RING_VERSION 1
+#define RING_HEADER  64
+#define RING_MAX_STR 0xFFFF
+/* We can't include fcntl.h, it declares open() using a different prototype */
+#define RING_O_RDWR  2
+
+struct ring_header
+{
+ uint32_t magic;
+ uint32_t version;
+ uint32_t rec_size;
+ uint32_t n_recs;    /* Power of 2 */
+ uint32_t str_size;  /* Power of 2 */
+ uint32_t reserved;
+ uint64_t head;      /* Next record to write */
+ uint64_t str_head;  /* Next byte to write in the strings area */
+};
+
+struct ring_record
+{
+ uint64_t seq;       /* index+1 once the record is complete, 0 while writing */
+ uint64_t ts;        /* CLOCK_MONOTONIC in ns */
+ uint64_t str;       /* Position of the text in the strings area */
+ int32_t arg;
+ uint32_t tid;
+ uint16_t kind;
+ uint16_t len;       /* Text length, without the terminator */
+ uint32_t reserved;
+};
+
+static struct ring_header *ring_hdr=NULL;
+static struct ring_record *ring_recs;
+static char *ring_strs;
+
+/* FNV-1a */
+static uint64_t str_hash(const char *text, size_t len)
+{
+ uint64_t hash=14695981039346656037ull;
+ size_t i;
+
+ for (i=0; i<len; i++)
+     hash=(hash ^ (unsigned char)text[i])*1099511628211ull;
+ return hash;
+}
+
+/* Most texts are repeated (titles, labels, file names), so we reuse them.
+   This is just a cache, a collision replaces the old entry. */
+#define STR_CACHE 1024
+static struct
+{
+ uint64_t pos;
+ uint32_t hash;
+ uint32_t len;
+} str_cache[STR_CACHE];
+static pthread_mutex_t str_cache_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/* Maps the ring created by KiAuto */
+static void ring_init(void)
+{
+ int (*real_open)(const char *, int, mode_t);
+ int (*real_close)(int);
+ const char *fn;
+ struct stat st;
+ struct ring_header *h;
+ int fd;
+
+ fn=getenv("KIAUTO_INTERPOSER_RING");
+ if (fn==NULL || !fn[0])
+    return;
+ /* Avoid our own open/close wrappers, they generate events */
+ real_open=dlsym(RTLD_NEXT,"open");
+ real_close=dlsym(RTLD_NEXT,"close");
+ if (!real_open || !real_close)
+    return;
+ fd=real_open(fn, RING_O_RDWR, 0);
+ if (fd<0)
+   {
+    printf("* Unable to open the ring %s, using stdout\n", fn);
+    return;
+   }
+ h=MAP_FAILED;
+ if (fstat(fd, &st)==0 && st.st_size>RING_HEADER)
+    h=mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+ real_close(fd);
+ if (h==MAP_FAILED)
+   {
+    printf("* Unable to map the ring %s, using stdout\n", fn);
+    return;
+   }
+ if (h->magic!=RING_MAGIC || h->version!=RING_VERSION || h->rec_size!=sizeof(struct ring_record) ||
+     !h->n_recs || (h->n_recs & (h->n_recs-1)) || h->str_size<256 || (h->str_size & (h->str_size-1)) ||
+     RING_HEADER+(uint64_t)h->n_recs*h->rec_size+h->str_size>(uint64_t)st.st_size)
+   {
+    printf("* Wrong ring format in %s, using stdout\n", fn);
+    munmap(h, st.st_size);
+    return;
+   }
+ ring_recs=(struct ring_record *)((char *)h+RING_HEADER);
+ ring_strs=(char *)(ring_recs+h->n_recs);
+ ring_hdr=h;
+}
+
+/* Reserves room for a text, they are never split at the end of the area.
+   The size must be less than str_size, or we will never find a place. */
+static uint64_t ring_alloc_str(uint32_t size)
+{
+ uint64_t pos;
+ do
+    pos=__atomic_fetch_add(&ring_hdr->str_head, size, __ATOMIC_RELAXED);
+ while ((pos & (ring_hdr->str_size-1))+size>ring_hdr->str_size);
+ return pos;
+}
+
+static uint64_t ring_copy_str(const char *text, uint32_t len)
+{
+ uint64_t pos=ring_alloc_str(len+1);
+ char *dest=ring_strs+(pos & (ring_hdr->str_size-1));
+
+ memcpy(dest, text, len);
+ dest[len]=0;
+ return pos;
+}
+
+static uint64_t ring_str(const char *text, uint32_t len)
+{
+ uint32_t hash=str_hash(text, len), mask=ring_hdr->str_size-1;
+ uint64_t pos;
+ int slot;
+
+ slot=hash & (STR_CACHE-1);
+ /* The cache is just an optimization, don't make the threads wait for it */
+ if (pthread_mutex_trylock(&str_cache_lock))
+    return ring_copy_str(text, len);
+ pos=str_cache[slot].pos;
+ /* Reuse it only if is recent enough, the reader could be behind */
+ if (str_cache[slot].hash==hash && str_cache[slot].len==len &&
+     __atomic_load_n(&ring_hdr->str_head, __ATOMIC_RELAXED)-pos<ring_hdr->str_size/2 &&
+     memcmp(ring_strs+(pos & mask), text, len)==0)
+   {
+    pthread_mutex_unlock(&str_cache_lock);
+    return pos;
+   }
+ pos=ring_copy_str(text, len);
+ str_cache[slot].pos=pos;
+ str_cache[slot].hash=hash;
+ str_cache[slot].len=len;
+ pthread_mutex_unlock(&str_cache_lock);
+ return pos;
+}
+
+/* Monotonic time in ns, the same clock used by Python's time.monotonic_ns() */
+static uint64_t now_ns(void)
+{
+ struct timespec ts;
+
+ clock_gettime(CLOCK_MONOTONIC, &ts);
+ return (uint64_t)ts.tv_sec*1000000000u+ts.tv_nsec;
+}
+
+static void ring_put(int kind, const char *text, int arg)
+{
+ struct ring_record *r;
+ uint64_t idx;
+ size_t len;
+
+ idx=__atomic_fetch_add(&ring_hdr->head, 1, __ATOMIC_RELAXED);
+ r=ring_recs+(idx & (ring_hdr->n_recs-1));
+ __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+ __atomic_thread_fence(__ATOMIC_RELEASE);
+ r->ts=now_ns();
+ r->arg=arg;
+ r->tid=syscall(SYS_gettid);
+ r->kind=kind;
+ len=0;
+ r->str=0;
+ if (ev_desc[kind].format==EVF_STR || ev_desc[kind].format==EVF_STR_INT)
+   {
+    len=strlen(text);
+    if (len>RING_MAX_STR)
+       len=RING_MAX_STR;
+    /* Must fit in the strings area, leaving room for the ones the reader didn't see yet */
+    if (len>=ring_hdr->str_size/4)
+       len=ring_hdr->str_size/4-1;
+    r->str=ring_str(text, len);
+   }
+ r->len=len;
+ __atomic_store_n(&r->seq, idx+1, __ATOMIC_RELEASE);
+}
+
+/* Add the time stamp (CLOCK_MONOTONIC ns) and the thread id to the text lines: "@NS TID EVENT" */
+static int ev_stamps=0;
+
+static void ev_print(int kind, const char *text, int arg, uint64_t ts, int tid)
+{
+ const char *prefix=ev_desc[kind].prefix;
+
+ if (ev_stamps)
+    printf("@%llu %d ", (unsigned long long)ts, tid);
+ switch (ev_desc[kind].format)
+   {
+    case EVF_NONE:
+         printf("%s\n", prefix);
+         break;
+    case EVF_STR:
+         printf("%s%s\n", prefix, text);
+         break;
+    case EVF_INT:
+         printf("%s%d\n", prefix, arg);
+         break;
+    case EVF_STR_INT:
+         printf("%s%s %d\n", prefix, text, arg);
+         break;
+    case EVF_HEX:
+         printf("%s0x%X\n", prefix, arg);
+         break;
+   }
+}
+
+/****************************************************************************
+ Text mode queue
+ The hooked threads don't write to stdout, they just queue the event and a
+ writer thread prints it. So KiCad threads (i.e. the 3D ray tracer workers)
+ don't block on the pipe.
+ This is a bounded MPSC queue, each slot has a sequence number (D. Vyukov),
+ the events are printed in the order they were queued.
+****************************************************************************/
+#define TQ_SIZE 8192
+
+static struct
+{
+ uint64_t seq;
+ uint64_t ts;
+ int kind;
+ int arg;
+ int tid;
+ char *text;
+} tq_slots[TQ_SIZE];
+static uint64_t tq_head;  /* Next slot to fill */
+static uint64_t tq_tail;  /* Next slot to print, protected by tq_consumer */
+static pthread_mutex_t tq_consumer=PTHREAD_MUTEX_INITIALIZER;
+static sem_t tq_sem;
+static int tq_active=0;
+
+static void tq_put(int kind, const char *text, int arg)
+{
+ uint64_t pos, seq;
+ int i;
+
+ pos=__atomic_load_n(&tq_head, __ATOMIC_RELAXED);
+ for (;;)
+    {
+     i=pos & (TQ_SIZE-1);
+     seq=__atomic_load_n(&tq_slots[i].seq, __ATOMIC_ACQUIRE);
+     if (seq==pos)
+       {
+        if (__atomic_compare_exchange_n(&tq_head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+           break;
+       }
+     else
+       {
+        if (seq<pos)
+           /* Full, only if nobody reads the pipe */
+           sched_yield();
+        pos=__atomic_load_n(&tq_head, __ATOMIC_RELAXED);
+       }
+    }
+ tq_slots[i].kind=kind;
+ tq_slots[i].arg=arg;
+ if (ev_stamps)
+   {
+    tq_slots[i].ts=now_ns();
+    tq_slots[i].tid=syscall(SYS_gettid);
+   }
+ tq_slots[i].text=ev_desc[kind].format==EVF_STR || ev_desc[kind].format==EVF_STR_INT ? strdup(text) : NULL;
+ __atomic_store_n(&tq_slots[i].seq, pos+1, __ATOMIC_RELEASE);
+ sem_post(&tq_sem);
+}
+
+/* Prints all the queued events, the caller must hold tq_consumer */
+static void tq_drain(void)
+{
+ int i;
+
+ for (;;)
+    {
+     i=tq_tail & (TQ_SIZE-1);
+     if (__atomic_load_n(&tq_slots[i].seq, __ATOMIC_ACQUIRE)!=tq_tail+1)
+        break;
+     ev_print(tq_slots[i].kind, tq_slots[i].text ? tq_slots[i].text : "(null)", tq_slots[i].arg, tq_slots[i].ts,
+              tq_slots[i].tid);
+     free(tq_slots[i].text);
+     __atomic_store_n(&tq_slots[i].seq, tq_tail+TQ_SIZE, __ATOMIC_RELEASE);
+     tq_tail++;
+    }
+ fflush(stdout);
+}
+
+static void *tq_writer(void *arg)
+{
+ for (;;)
+    {
+     if (sem_wait(&tq_sem) && errno==EINTR)
+        continue;
+     pthread_mutex_lock(&tq_consumer);
+     tq_drain();
+     pthread_mutex_unlock(&tq_consumer);
+    }
+ return arg;
+}
+
+/* After fork the writer isn't there, print directly */
+static void tq_child(void)
+{
+ tq_active=0;
+ pthread_mutex_init(&tq_consumer, NULL);
+}
+
+static void tq_init(void)
+{
+ pthread_t writer;
+ pthread_attr_t attr;
+ int i;
+
+ for (i=0; i<TQ_SIZE; i++)
+     tq_slots[i].seq=i;
+ if (sem_init(&tq_sem, 0, 0))
+    return;
+ pthread_attr_init(&attr);
+ pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+ if (pthread_create(&writer, &attr, tq_writer, NULL)==0)
+   {
+    pthread_atfork(NULL, NULL, tq_child);
+    tq_active=1;
+   }
+ pthread_attr_destroy(&attr);
+}
+
+/* Print what's pending when the process exits.
+   Must be the last destructor, stats_dump (102) can queue events. */
+__attribute__((destructor(101))) static void tq_end(void)
+{
+ if (!tq_active)
+    return;
+ pthread_mutex_lock(&tq_consumer);
+ tq_drain();
+ pthread_mutex_unlock(&tq_consumer);
+}
+
+static void ev_send(int kind, const char *text, int arg)
+{
+ if (text==NULL)
+    text="(null)";
+ if (ring_hdr)
+    ring_put(kind, text, arg);
+ else if (tq_active)
+    tq_put(kind, text, arg);
+ else
+   {
+    if (ev_stamps)
+       ev_print(kind, text, arg, now_ns(), syscall(SYS_gettid));
+    else
+       ev_print(kind, text, arg, 0, 0);
+    fflush(stdout);
+   }
+}
+
+/* Formatted version, used for the less common messages */
+static void ev_sendf(int kind, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void ev_sendf(int kind, const char *fmt, ...)
+{
+ char buf[1024];
+ va_list ap;
+
+ va_start(ap, fmt);
+ vsnprintf(buf, sizeof(buf), fmt, ap);
+ va_end(ap);
+ ev_send(kind, buf, 0);
+}
+
+
+/* Reads a control file without using our wrappers */
+static gchar *load_file(const char *fn)
+{
+ int (*real_open)(const char *, int, mode_t);
+ int (*real_close)(int);
+ struct stat st;
+ gchar *buf=NULL;
+ int fd;
+
+ real_open=dlsym(RTLD_NEXT,"open");
+ real_close=dlsym(RTLD_NEXT,"close");
+ if (!real_open || !real_close)
+    return NULL;
+ fd=real_open(fn, 0 /* O_RDONLY */, 0);
+ if (fd<0)
+   {
+    ev_sendf(EV_INFO, "Unable to open %s", fn);
+    return NULL;
+   }
+ if (fstat(fd, &st)==0 && (buf=malloc(st.st_size+1))!=NULL)
+   {
+    ssize_t got=read(fd, buf, st.st_size);
+    buf[got>0 ? got : 0]=0;
+   }
+ real_close(fd);
+ return buf;
+}
+
+
+/* Writes a control file without using our wrappers */
+static void save_file(const char *fn, const char *text)
+{
+ int (*real_open)(const char *, int, mode_t);
+ int (*real_close)(int);
+ int fd;
+
+ real_open=dlsym(RTLD_NEXT,"open");
+ real_close=dlsym(RTLD_NEXT,"close");
+ if (!real_open || !real_close)
+    return;
+ fd=real_open(fn, 01101 /* O_WRONLY|O_CREAT|O_TRUNC */, 0600);
+ if (fd<0)
+   {
+    ev_sendf(EV_INFO, "Unable to write %s", fn);
+    return;
+   }
+ if (write(fd, text, strlen(text))<0)
+    ev_sendf(EV_INFO, "Unable to write %s", fn);
+ real_close(fd);
+}
+
+
+/****************************************************************************
+ Start-up profile
+ When KIAUTO_INTERPOSER_STARTUP is defined (a file name) we record what
+ KiCad does from the moment we are loaded to the first time it enters the
+ main loop: the libraries loaded using dlopen, the files opened (added per
+ directory, including the failed attempts) and the window titles and shown
+ windows (milestones). The raw data is stored in the file when the main loop
+ starts (or at exit), kiauto/startup.py makes the report. Lines:
+ start NS / end NS main|exit / mark NS KIND:TEXT
+ dlopen NS DURATION DEPTH OK NAME
+ dir OPENS MISSES DURATION FIRST LAST PHASE PATH (phase = marks before it)
+ Times are CLOCK_MONOTONIC ns, the same used by KiAuto.
+****************************************************************************/
+#define SP_MAX_MARKS  64
+#define SP_MAX_DLOPEN 256
+
+struct sp_dir
+{
+ uint64_t opens, misses, ns, first, last;
+};
+
+static const char *sp_file;
+static int sp_active;
+static pid_t sp_pid;
+static uint64_t sp_start;
+static pthread_mutex_t sp_lock=PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *sp_dirs;
+static GString *sp_events;
+static int sp_marks;
+#if HOOK_DLOPEN
+static int sp_dlopens;
+static __thread int sp_depth;
+#endif
+
+#if HOOK_IO
+static char *io_full_path(int dirfd, const char *path);
+#endif
+
+static void sp_init(void)
+{
+ sp_file=getenv("KIAUTO_INTERPOSER_STARTUP");
+ if (!sp_file || !sp_file[0])
+    return;
+ sp_start=now_ns();
+ sp_pid=getpid();
+ sp_dirs=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+ sp_events=g_string_new(NULL);
+ sp_active=1;
+}
+
+/* Names can't break the line oriented format */
+static void sp_append_name(GString *s, const char *name)
+{
+ for (; *name; name++)
+     g_string_append_c(s, *name=='\n' ? ' ' : *name);
+ g_string_append_c(s, '\n');
+}
+
+/* A window title or a window shown */
+static void sp_mark(const char *kind, const char *text, uint64_t ts)
+{
+ if (!sp_active || getpid()!=sp_pid)
+    return;
+ pthread_mutex_lock(&sp_lock);
+ /* Checked again, sp_finish could be running */
+ if (sp_active && sp_marks++<SP_MAX_MARKS)
+   {
+    g_string_append_printf(sp_events, "mark %llu %s:", (unsigned long long)ts, kind);
+    sp_append_name(sp_events, text ? text : "");
+   }
+ pthread_mutex_unlock(&sp_lock);
+}
+
+#if HOOK_DLOPEN
+static void sp_dlopen(const char *filename, int ok, uint64_t t1, uint64_t t2)
+{
+ if (!sp_active || getpid()!=sp_pid)
+    return;
+ pthread_mutex_lock(&sp_lock);
+ if (sp_active && sp_dlopens++<SP_MAX_DLOPEN)
+   {
+    g_string_append_printf(sp_events, "dlopen %llu %llu %d %d ", (unsigned long long)t1,
+                           (unsigned long long)(t2-t1), sp_depth, ok);
+    sp_append_name(sp_events, filename ? filename : "(main program)");
+   }
+ pthread_mutex_unlock(&sp_lock);
+}
+#endif /* HOOK_DLOPEN */
+
+#if HOOK_IO
+/* A file opened (or not found) during the start-up, added to its directory */
+static void sp_open(int dirfd, const char *pathname, int failed, uint64_t t1, uint64_t t2)
+{
+ int err=errno;
+ char *full, *slash;
+ struct sp_dir *d;
+
+ if (!sp_active || pathname==NULL || getpid()!=sp_pid)
+    return;
+ full=io_full_path(dirfd, pathname);
+ if (full)
+   {
+    slash=strrchr(full, '/');
+    if (slash)
+       *(slash==full ? slash+1 : slash)=0;
+    pthread_mutex_lock(&sp_lock);
+    if (sp_active)
+      {
+       /* Directories are accounted for each phase (between marks) */
+       gchar *key=g_strdup_printf("%d %s", sp_marks<SP_MAX_MARKS ? sp_marks : SP_MAX_MARKS, full);
+       d=g_hash_table_lookup(sp_dirs, key);
+       if (!d)
+         {
+          d=g_new0(struct sp_dir, 1);
+          d->first=t1;
+          g_hash_table_insert(sp_dirs, key, d);
+         }
+       else
+          g_free(key);
+       d->opens++;
+       d->misses+=failed;
+       d->ns+=t2-t1;
+       d->last=t2;
+      }
+    pthread_mutex_unlock(&sp_lock);
+    free(full);
+   }
+ /* The caller could check errno */
+ errno=err;
+}
+#endif /* HOOK_IO */
+
+/* Stores the profile, end is "main" (the main loop started) or "exit" */
+static void sp_finish(const char *end)
+{
+ GHashTableIter it;
+ gpointer key, value;
+ GString *out;
+
+ if (!sp_active || getpid()!=sp_pid)
+    return;
+ pthread_mutex_lock(&sp_lock);
+ if (!sp_active)
+   { /* Another thread did it */
+    pthread_mutex_unlock(&sp_lock);
+    return;
+   }
+ sp_active=0;
+ out=g_string_new(NULL);
+ g_string_append_printf(out, "start %llu\nend %llu %s\n", (unsigned long long)sp_start, (unsigned long long)now_ns(), end);
+ g_string_append(out, sp_events->str);
+ g_hash_table_iter_init(&it, sp_dirs);
+ while (g_hash_table_iter_next(&it, &key, &value))
+   {
+    struct sp_dir *d=value;
+    g_string_append_printf(out, "dir %llu %llu %llu %llu %llu ", (unsigned long long)d->opens,
+                           (unsigned long long)d->misses, (unsigned long long)d->ns, (unsigned long long)d->first,
+                           (unsigned long long)d->last);
+    sp_append_name(out, key);
+   }
+ g_hash_table_destroy(sp_dirs);
+ g_string_free(sp_events, TRUE);
+ pthread_mutex_unlock(&sp_lock);
+ save_file(sp_file, out->str);
+ g_string_free(out, TRUE);
+ ev_sendf(EV_INFO, "Start-up profile stored in %s", sp_file);
+}
+
+
+/****************************************************************************
+ Hooks statistics
+ When KIAUTO_INTERPOSER_STATS is defined (a file name) each wrapper records
+ the time spent in the real function and its own overhead. They are log2
+ histograms (ns) updated using atomics, no locks. The summary is stored in
+ the file when KiCad exits.
+****************************************************************************/
+enum
+{
+ HK_GLXSWAPBUFFERS, HK_PANGO_LAYOUT_SET_TEXT, HK_GTK_WINDOW_SET_TITLE, HK_GTK_WINDOW_SET_MODAL,
+ HK_GTK_DIALOG_RUN, HK_GTK_WIDGET_SHOW, HK_GTK_BUTTON_SET_LABEL, HK_GTK_PRINT_OPERATION_RUN,
+ HK_GTK_LABEL_SET_TEXT_WITH_MNEMONIC, HK_GTK_FILE_CHOOSER_GET_FILENAME, HK_FOPEN64, HK_FOPEN,
+ HK_FCLOSE, HK_GTK_MAIN, HK_GTK_WIDGET_DESTROY, HK_OPEN64,
+ HK_OPEN, HK_OPENAT64, HK_OPENAT, HK_CLOSE,
+ HK_RENAME, HK_RENAMEAT, HK_DLOPEN, HK_GTK_PROGRESS_BAR_SET_FRACTION,
+ HK_COUNT
+};
+
+static const char *hk_names[HK_COUNT]=
+{
+ "glXSwapBuffers", "pango_layout_set_text", "gtk_window_set_title", "gtk_window_set_modal",
+ "gtk_dialog_run", "gtk_widget_show", "gtk_button_set_label", "gtk_print_operation_run",
+ "gtk_label_set_text_with_mnemonic", "gtk_file_chooser_get_filename", "fopen64", "fopen",
+ "fclose", "gtk_main", "gtk_widget_destroy", "open64",
+ "open", "openat64", "openat", "close",
+ "rename", "renameat", "dlopen", "gtk_progress_bar_set_fraction"
+};
+
+#define HIST_BUCKETS 40
+
+struct hist
+{
+ uint64_t buckets[HIST_BUCKETS];
+ uint64_t max;
+};
+
+static struct
+{
+ uint64_t count;
+ struct hist self, next;
+} hk_stats[HK_COUNT];
+static const char *stats_file;
+/* Only the process that loaded us, not the children */
+static pid_t stats_pid;
+
+/* The start-up profile also needs the times */
+static inline uint64_t st_now(void)
+{
+ return stats_file || sp_active ? now_ns() : 0;
+}
+
+static void hist_add(struct hist *h, uint64_t ns)
+{
+ int b=ns ? 64-__builtin_clzll(ns) : 0;
+ uint64_t max=__atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+ __atomic_fetch_add(&h->buckets[b<HIST_BUCKETS ? b : HIST_BUCKETS-1], 1, __ATOMIC_RELAXED);
+ while (ns>max && !__atomic_compare_exchange_n(&h->max, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* t0 wrapper entry, t1 and t2 around the real function (0 if not called) */
+static void st_add(int hook, uint64_t t0, uint64_t t1, uint64_t t2)
+{
+ uint64_t t3;
+
+ if (!t0 || !stats_file)
+    return;
+ t3=now_ns();
+ if (!t1)
+    t1=t2=t3;
+ __atomic_fetch_add(&hk_stats[hook].count, 1, __ATOMIC_RELAXED);
+ hist_add(&hk_stats[hook].self, (t1-t0)+(t3-t2));
+ hist_add(&hk_stats[hook].next, t2-t1);
+}
+
+/* Upper limit of the bucket containing the percentile (limited to the max), in us */
+static double hist_percentile(struct hist *h, uint64_t count, int p)
+{
+ uint64_t acc=0, rank=(count*p+99)/100, limit;
+ int b;
+
+ for (b=0; b<HIST_BUCKETS; b++)
+    {
+     acc+=h->buckets[b];
+     if (acc>=rank)
+        break;
+    }
+ limit=b ? 1ull<<b : 0;
+ return (double)(limit<h->max ? limit : h->max)/1000;
+}
+
+static void stats_init(void)
+{
+ stats_file=getenv("KIAUTO_INTERPOSER_STATS");
+ if (stats_file && !stats_file[0])
+    stats_file=NULL;
+ stats_pid=getpid();
+}
+
+/* Before tq_end (101), sp_finish and the I/O here generate events */
+__attribute__((destructor(102))) static void stats_dump(void)
+{
+ GString *out;
+ int i;
+
+ /* KiCad didn't reach the main loop */
+ sp_finish("exit");
+ if (!stats_file || getpid()!=stats_pid)
+    return;
+ out=g_string_new(NULL);
+ g_string_append_printf(out, "%-32s %6s %8s %8s %8s %10s %10s %10s (us)\n", "hook", "calls", "self p50", "p99", "max",
+                        "call p50", "p99", "max");
+ for (i=0; i<HK_COUNT; i++)
+    {
+     uint64_t n=hk_stats[i].count;
+     if (!n)
+        continue;
+     g_string_append_printf(out, "%-32s %6llu %8.1f %8.1f %8.1f %10.1f %10.1f %10.1f\n", hk_names[i],
+                            (unsigned long long)n, hist_percentile(&hk_stats[i].self, n, 50),
+                            hist_percentile(&hk_stats[i].self, n, 99), (double)hk_stats[i].self.max/1000,
+                            hist_percentile(&hk_stats[i].next, n, 50), hist_percentile(&hk_stats[i].next, n, 99),
+                            (double)hk_stats[i].next.max/1000);
+    }
+ save_file(stats_file, out->str);
+ g_string_free(out, TRUE);
+}
+
+
+/****************************************************************************
+ Real functions
+ All the wrapped symbols are resolved by the constructor, in a table indexed
+ by the hook (HK_*), so the wrappers just make an indirect call. Calls made
+ before it (i.e. from the constructors of the libraries we use) resolve the
+ symbol on the fly, dlsym always returns the same address, so the threads
+ can do it at the same time.
+****************************************************************************/
+static void *hk_real[HK_COUNT];
+
+static void *hk_resolve(int hook)
+{
+ void *f=dlsym(RTLD_NEXT, hk_names[hook]);
+
+ __atomic_store_n(&hk_real[hook], f, __ATOMIC_RELEASE);
+ return f;
+}
+
+static inline void *hk_next(int hook)
+{
+ void *f=__atomic_load_n(&hk_real[hook], __ATOMIC_ACQUIRE);
+
+ return f ? f : hk_resolve(hook);
+}
+
+/* Hooks not included in this profile */
+static int hk_excluded(int hook)
+{
+ switch (hook)
+   {
+    case HK_GLXSWAPBUFFERS:
+         return !HOOK_GLX;
+    case HK_GTK_PRINT_OPERATION_RUN:
+         return !HOOK_PRINT;
+    case HK_GTK_BUTTON_SET_LABEL:
+    case HK_GTK_LABEL_SET_TEXT_WITH_MNEMONIC:
+         return !HOOK_LABEL;
+    case HK_FOPEN64:
+    case HK_FOPEN:
+    case HK_FCLOSE:
+    case HK_OPEN64:
+    case HK_OPEN:
+    case HK_OPENAT64:
+    case HK_OPENAT:
+    case HK_CLOSE:
+    case HK_RENAME:
+    case HK_RENAMEAT:
+         return !HOOK_IO;
+    case HK_DLOPEN:
+         return !HOOK_DLOPEN;
+   }
+ return 0;
+}
+
+/* Failed lookups are reported in one message */
+static void hk_init(void)
+{
+ GString *missing=g_string_new(NULL);
+ int i, n=0;
+
+ for (i=0; i<HK_COUNT; i++)
+    {
+     if (hk_excluded(i))
+        continue;
+     if (hk_real[i] || hk_resolve(i))
+        n++;
+     else
+        g_string_append_printf(missing, " %s", hk_names[i]);
+    }
+ if (missing->len)
+    ev_sendf(EV_ERROR, "Unable to resolve:%s", missing->str);
+ ev_sendf(EV_INFO, "Wrapping %d functions", n);
+ g_string_free(missing, TRUE);
+}
+
+
+#if HOOK_GLX
+/****************************************************************************
+ Frame capture
+ When KIAUTO_INTERPOSER_CAPTURE is defined we keep a copy of the last frame.
+ The back buffer is read before the swap, using a pixel buffer object if
+ available, so the transfer runs while the real swap is done. Two PBOs take
+ turns: the frame N-1 is mapped while the frame N is read, so we never wait
+ for the GPU. The last frame is mapped when the render settles or at the
+ frame indicated by KIAUTO_INTERPOSER_CAPTURE_FRAME, then stored as PNG.
+ Nothing is captured if the application left a framebuffer object bound.
+****************************************************************************/
+static const char *cap_path;
+static int cap_at_frame=-1;
+static pthread_mutex_t cap_lock=PTHREAD_MUTEX_INITIALIZER;
+static guchar *cap_pixels;
+static size_t cap_size;
+static int cap_w, cap_h, cap_frame=-1, cap_saved=-1;
+/* Pixel buffer object, when supported */
+static PFNGLGENBUFFERSPROC cap_gen_buffers;
+static PFNGLBINDBUFFERPROC cap_bind_buffer;
+static PFNGLBUFFERDATAPROC cap_buffer_data;
+static PFNGLMAPBUFFERPROC cap_map_buffer;
+static PFNGLUNMAPBUFFERPROC cap_unmap_buffer;
+struct cap_slot
+{
+ GLuint pbo;
+ size_t size;
+ /* frame is -1 when there is nothing to map */
+ int w, h, frame;
+};
+static struct cap_slot cap_slots[2]={{0, 0, 0, 0, -1}, {0, 0, 0, 0, -1}};
+static int cap_cur;
+/* Where the PBOs live, to map the last one from the main loop */
+static Display *cap_dpy;
+static GLXDrawable cap_drawable;
+static GLXContext cap_ctx;
+/* Blocking capture */
+static int cap_pending_w, cap_pending_h;
+
+static void cap_init(void)
+{
+ const char *frame;
+
+ cap_path=getenv("KIAUTO_INTERPOSER_CAPTURE");
+ if (cap_path==NULL || !cap_path[0])
+   {
+    cap_path=NULL;
+    return;
+   }
+ frame=getenv("KIAUTO_INTERPOSER_CAPTURE_FRAME");
+ if (frame && frame[0])
+    cap_at_frame=atoi(frame);
+ cap_gen_buffers=(PFNGLGENBUFFERSPROC)glXGetProcAddressARB((const GLubyte *)"glGenBuffers");
+ cap_bind_buffer=(PFNGLBINDBUFFERPROC)glXGetProcAddressARB((const GLubyte *)"glBindBuffer");
+ cap_buffer_data=(PFNGLBUFFERDATAPROC)glXGetProcAddressARB((const GLubyte *)"glBufferData");
+ cap_map_buffer=(PFNGLMAPBUFFERPROC)glXGetProcAddressARB((const GLubyte *)"glMapBuffer");
+ cap_unmap_buffer=(PFNGLUNMAPBUFFERPROC)glXGetProcAddressARB((const GLubyte *)"glUnmapBuffer");
+ if (!cap_gen_buffers || !cap_bind_buffer || !cap_buffer_data || !cap_map_buffer || !cap_unmap_buffer)
+   {
+    cap_gen_buffers=NULL;
+    ev_send(EV_INFO, "No pixel buffer objects, using a blocking capture", 0);
+   }
+ ev_sendf(EV_INFO, "Capturing frames to %s", cap_path);
+}
+
+/* Makes room for a frame in our copy, cap_lock must be locked */
+static int cap_reserve(int w, int h)
+{
+ size_t size=(size_t)w*h*3;
+
+ if (size>cap_size)
+   {
+    guchar *p=realloc(cap_pixels, size);
+    if (!p)
+       return 0;
+    cap_pixels=p;
+    cap_size=size;
+   }
+ cap_w=w;
+ cap_h=h;
+ return 1;
+}
+
+/* Called before the swap, starts reading the back buffer */
+static void cap_read_start(Display *dpy, GLXDrawable drawable, int frame)
+{
+ GLint vp[4], read_buf, pack_align, pack_pbo=0, fbo=0;
+ size_t size;
+
+ cap_pending_w=cap_pending_h=0;
+ /* GL_BACK isn't valid for glReadBuffer when a FBO is bound */
+ glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &fbo);
+ if (fbo)
+    return;
+ glGetIntegerv(GL_VIEWPORT, vp);
+ if (vp[2]<=0 || vp[3]<=0)
+    return;
+ glGetIntegerv(GL_READ_BUFFER, &read_buf);
+ glGetIntegerv(GL_PACK_ALIGNMENT, &pack_align);
+ glReadBuffer(GL_BACK);
+ glPixelStorei(GL_PACK_ALIGNMENT, 1);
+ size=(size_t)vp[2]*vp[3]*3;
+ if (cap_gen_buffers)
+   {
+    /* The other slot has the previous frame, mapped after the swap */
+    struct cap_slot *slot=&cap_slots[cap_cur];
+
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pack_pbo);
+    if (!slot->pbo)
+       cap_gen_buffers(1, &slot->pbo);
+    cap_bind_buffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+    if (size!=slot->size)
+      {
+       cap_buffer_data(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+       slot->size=size;
+      }
+    /* Asynchronous, the data goes to the PBO */
+    glReadPixels(vp[0], vp[1], vp[2], vp[3], GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    cap_bind_buffer(GL_PIXEL_PACK_BUFFER, pack_pbo);
+    slot->w=vp[2];
+    slot->h=vp[3];
+    slot->frame=frame;
+    cap_dpy=dpy;
+    cap_drawable=drawable;
+    cap_ctx=glXGetCurrentContext();
+   }
+ else
+   {
+    pthread_mutex_lock(&cap_lock);
+    if (cap_reserve(vp[2], vp[3]))
+      {
+       glReadPixels(vp[0], vp[1], vp[2], vp[3], GL_RGB, GL_UNSIGNED_BYTE, cap_pixels);
+       cap_pending_w=vp[2];
+       cap_pending_h=vp[3];
+      }
+    pthread_mutex_unlock(&cap_lock);
+   }
+ glPixelStorei(GL_PACK_ALIGNMENT, pack_align);
+ glReadBuffer(read_buf);
+}
+
+/* Copies a PBO to our copy, the GL context must be current */
+static void cap_map_slot(struct cap_slot *slot)
+{
+ GLint pack_pbo;
+ void *data;
+
+ if (slot->frame<0)
+    return;
+ glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pack_pbo);
+ cap_bind_buffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+ data=cap_map_buffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+ if (data)
+   {
+    pthread_mutex_lock(&cap_lock);
+    if (cap_reserve(slot->w, slot->h))
+      {
+       memcpy(cap_pixels, data, (size_t)cap_w*cap_h*3);
+       cap_frame=slot->frame;
+      }
+    pthread_mutex_unlock(&cap_lock);
+    cap_unmap_buffer(GL_PIXEL_PACK_BUFFER);
+   }
+ cap_bind_buffer(GL_PIXEL_PACK_BUFFER, pack_pbo);
+ slot->frame=-1;
+}
+
+/* Called after the swap, copies the previous frame (already transferred) */
+static void cap_read_end(int frame)
+{
+ if (cap_gen_buffers)
+   {
+    cap_map_slot(&cap_slots[!cap_cur]);
+    /* The one we want to save, we can't wait for the next one */
+    if (frame==cap_at_frame)
+       cap_map_slot(&cap_slots[cap_cur]);
+    cap_cur=!cap_cur;
+    return;
+   }
+ if (!cap_pending_w)
+    return;
+ pthread_mutex_lock(&cap_lock);
+ cap_frame=frame;
+ pthread_mutex_unlock(&cap_lock);
+}
+
+/* Is the last frame still in a PBO? Only used by the settle thread, the value is just a hint */
+static int cap_last_pending(void)
+{
+ return cap_gen_buffers && cap_slots[!cap_cur].frame>=0;
+}
+
+/* Stores the last frame as PNG, OpenGL rows are bottom to top */
+static void cap_save(void)
+{
+ GdkPixbuf *pb, *flipped;
+ GError *error=NULL;
+ int frame;
+
+ pthread_mutex_lock(&cap_lock);
+ frame=cap_frame;
+ if (frame<0 || frame==cap_saved)
+   {
+    pthread_mutex_unlock(&cap_lock);
+    return;
+   }
+ pb=gdk_pixbuf_new_from_data(cap_pixels, GDK_COLORSPACE_RGB, FALSE, 8, cap_w, cap_h, cap_w*3, NULL, NULL);
+ flipped=gdk_pixbuf_flip(pb, FALSE);
+ if (!flipped || !gdk_pixbuf_save(flipped, cap_path, "png", &error, NULL))
+   {
+    ev_sendf(EV_ERROR, "Unable to save the capture %s: %s", cap_path, error ? error->message : "no memory");
+    if (error)
+       g_error_free(error);
+    frame=-1;
+   }
+ else
+    cap_saved=frame;
+ if (flipped)
+    g_object_unref(flipped);
+ g_object_unref(pb);
+ pthread_mutex_unlock(&cap_lock);
+ if (frame>=0)
+    ev_send(EV_GLX_CAPTURED, cap_path, frame);
+}
+
+/* Maps the last frame from the main loop, where the GL context lives, then saves it and reports the
+   render as settled */
+static gboolean cap_settled_idle(gpointer data)
+{
+ GLXContext ctx=glXGetCurrentContext();
+ Display *dpy=glXGetCurrentDisplay();
+ GLXDrawable draw=glXGetCurrentDrawable(), read=glXGetCurrentReadDrawable();
+
+ if (ctx==cap_ctx)
+    cap_map_slot(&cap_slots[!cap_cur]);
+ else if (glXMakeCurrent(cap_dpy, cap_drawable, cap_ctx))
+   {
+    cap_map_slot(&cap_slots[!cap_cur]);
+    if (ctx)
+       glXMakeContextCurrent(dpy, draw, read, ctx);
+    else
+       glXMakeCurrent(cap_dpy, None, NULL);
+   }
+ cap_save();
+ ev_send(EV_GLX_SETTLED, NULL, GPOINTER_TO_INT(data));
+ return FALSE;
+}
+
+
+/****************************************************************************
+ OpenGL frames
+ Each swap reports the frame number, when it started and the time spent in
+ the real glXSwapBuffers (both in us, monotonic clock).
+ When KIAUTO_INTERPOSER_SETTLE is defined (ms) a thread reports the render
+ as settled after this time without new frames.
+****************************************************************************/
+static pthread_mutex_t settle_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t settle_cond;
+static int settle_active;
+static uint64_t settle_ns;
+/* End of the last swap, 0 when already reported */
+static uint64_t settle_last;
+static int settle_frame;
+
+static void *settle_watch(void *arg)
+{
+ struct timespec ts;
+ uint64_t deadline;
+ int frame;
+
+ pthread_mutex_lock(&settle_lock);
+ for (;;)
+    {
+     if (!settle_last)
+       {
+        pthread_cond_wait(&settle_cond, &settle_lock);
+        continue;
+       }
+     deadline=settle_last+settle_ns;
+     if (now_ns()<deadline)
+       { /* New swaps just move the deadline */
+        ts.tv_sec=deadline/1000000000u;
+        ts.tv_nsec=deadline%1000000000u;
+        pthread_cond_timedwait(&settle_cond, &settle_lock, &ts);
+        continue;
+       }
+     settle_last=0;
+     frame=settle_frame;
+     pthread_mutex_unlock(&settle_lock);
+     /* The capture is reported before, so it's ready when we say settled */
+     if (cap_path && cap_at_frame<0 && cap_last_pending())
+        g_idle_add(cap_settled_idle, GINT_TO_POINTER(frame));
+     else
+       {
+        if (cap_path && cap_at_frame<0)
+           cap_save();
+        ev_send(EV_GLX_SETTLED, NULL, frame);
+       }
+     pthread_mutex_lock(&settle_lock);
+    }
+ return arg;
+}
+
+static void settle_init(void)
+{
+ pthread_condattr_t cattr;
+ pthread_attr_t attr;
+ pthread_t watch;
+ char *ms;
+
+ ms=getenv("KIAUTO_INTERPOSER_SETTLE");
+ if (ms==NULL || atoi(ms)<=0)
+    return;
+ settle_ns=(uint64_t)atoi(ms)*1000000u;
+ pthread_condattr_init(&cattr);
+ pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+ pthread_cond_init(&settle_cond, &cattr);
+ pthread_condattr_destroy(&cattr);
+ pthread_attr_init(&attr);
+ pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+ if (pthread_create(&watch, &attr, settle_watch, NULL)==0)
+    settle_active=1;
+ else
+    ev_send(EV_INFO, "Unable to start the render settle thread", 0);
+ pthread_attr_destroy(&attr);
+}
+
+INTERPOSED void glXSwapBuffers(Display *dpy, GLXDrawable drawable)
+{
+ void (*next_func)(Display *, GLXDrawable)=hk_next(HK_GLXSWAPBUFFERS);
+ uint64_t t0=st_now();
+ static int cnt=0;
+ uint64_t start, end;
+ char buf[64];
+
+ if (cnt==0)
+   { /* First frame, we have a GL context */
+    settle_init();
+    cap_init();
+   }
+
+ if (cap_path)
+    cap_read_start(dpy, drawable, cnt);
+ start=now_ns();
+ next_func(dpy, drawable);
+ end=now_ns();
+ if (cap_path)
+   {
+    cap_read_end(cnt);
+    if (cnt==cap_at_frame)
+       cap_save();
+   }
+ snprintf(buf, sizeof(buf), "%d %llu %llu", cnt, (unsigned long long)(start/1000),
+          (unsigned long long)((end-start)/1000));
+ ev_send(EV_GLX_SWAP, buf, cnt);
+ if (settle_active)
+   {
+    pthread_mutex_lock(&settle_lock);
+    if (!settle_last)
+       /* The thread is waiting without time-out */
+       pthread_cond_signal(&settle_cond);
+    settle_last=end;
+    settle_frame=cnt;
+    pthread_mutex_unlock(&settle_lock);
+   }
+ cnt++;
+ st_add(HK_GLXSWAPBUFFERS, t0, start, end);
+}
+#endif /* HOOK_GLX */
+
+/* Texts used by KiCad to measure the size, not really displayed */
+static const char *pango_ignored[]=
+{
+ "g",
+ "...",
+ "\xE2\x97\x8F",  /* Ball 1 */
+ "\xE2\x80\xA2",  /* Ball 2 */
+ "ABCDEFHXfgkj"   /* To meassure? */
+};
+#define PANGO_IGNORED (sizeof(pango_ignored)/sizeof(pango_ignored[0]))
+static uint64_t pango_ignored_hash[PANGO_IGNORED];
+static GQuark pango_last_text;
+
+static void pango_init(void)
+{
+ unsigned i;
+
+ for (i=0; i<PANGO_IGNORED; i++)
+     pango_ignored_hash[i]=str_hash(pango_ignored[i], strlen(pango_ignored[i])) | 1;
+ pango_last_text=g_quark_from_static_string("kiauto-last-text");
+}
+
+INTERPOSED void pango_layout_set_text(PangoLayout *layout, const char *text, int length)
+{
+ void (*next_func)(PangoLayout *, const char *, int)=hk_next(HK_PANGO_LAYOUT_SET_TEXT);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ static uint64_t last_hash=0;
+ uint64_t hash;
+ size_t len;
+ unsigned i;
+
+ len=text==NULL ? 0 : (length<0 ? strlen(text) : (size_t)length);
+ /* Filter what we log */
+ if (len)  /* Emty strings??!! */
+   {
+    hash=str_hash(text, len) | 1;
+    for (i=0; i<PANGO_IGNORED && pango_ignored_hash[i]!=hash; i++);
+    /* Avoid repetition, most stuff is sent 3 times!!!
+       We remember the last text for each layout, KiCad interleaves them */
+    if (i==PANGO_IGNORED && hash!=last_hash &&
+        (uintptr_t)g_object_get_qdata(G_OBJECT(layout), pango_last_text)!=(uintptr_t)hash)
+      {
+       if (length>=0)
+         { /* Could be not terminated */
+          gchar *copy=g_strndup(text, len);
+          ev_send(EV_PANGO, copy, 0);
+          g_free(copy);
+         }
+       else
+          ev_send(EV_PANGO, text, 0);
+      }
+    if (i==PANGO_IGNORED)
+      {
+       last_hash=hash;
+       g_object_set_qdata(G_OBJECT(layout), pango_last_text, (gpointer)(uintptr_t)hash);
+      }
+   }
+ t1=st_now();
+ next_func(layout, text, length);
+ t2=st_now();
+ st_add(HK_PANGO_LAYOUT_SET_TEXT, t0, t1, t2);
+}
+
+
+INTERPOSED void gtk_window_set_title(GtkWindow *window, const gchar *title)
+{
+ void (*next_func)(GtkWindow *window, const gchar *title)=hk_next(HK_GTK_WINDOW_SET_TITLE);
+ uint64_t t0=st_now(), t1=0, t2=0;
+
+ t1=st_now();
+ next_func(window, title);
+ t2=st_now();
+ ev_send(EV_WIN_TITLE, title, 0);
+ sp_mark("Title", title, t1);
+ st_add(HK_GTK_WINDOW_SET_TITLE, t0, t1, t2);
+}
+
+
+INTERPOSED void gtk_window_set_modal(GtkWindow* window, gboolean modal)
+{
+ void (*next_func)(GtkWindow* window, gboolean modal)=hk_next(HK_GTK_WINDOW_SET_MODAL);
+ uint64_t t0=st_now(), t1=0, t2=0;
+
+ t1=st_now();
+ next_func(window, modal);
+ t2=st_now();
+ ev_send(EV_WIN_MODAL, gtk_window_get_title(window), modal);
+ st_add(HK_GTK_WINDOW_SET_MODAL, t0, t1, t2);
+}
+
+
+/****************************************************************************
+ Texts remapping
+ Used to add accelerators to the KiCad dialogs. The rules are loaded from
+ the file indicated by KIAUTO_INTERPOSER_REMAP, only the ones for the
+ KiCad version in KIAUTO_INTERPOSER_KICAD are used.
+ Format: VERSION|WIDGET|TEXT|NEW_TEXT (see kiauto/interposer/remap.txt)
+ The dialogs policy (KIAUTO_INTERPOSER_DIALOGS) uses the same format.
+****************************************************************************/
+enum { REMAP_BUTTON, REMAP_LABEL, REMAP_DIALOG, REMAP_KINDS };
+#define MAX_REMAP_PREFIXES 16
+
+static struct
+{
+ GHashTable *exact;
+ int n_prefixes;
+ char *prefix[MAX_REMAP_PREFIXES];
+ int prefix_len[MAX_REMAP_PREFIXES];
+ char *prefix_new[MAX_REMAP_PREFIXES];
+} remaps[REMAP_KINDS];
+
+static int remap_version_ok(const char *ver, int kicad)
+{
+ int v;
+ char *end;
+
+ if (strcmp(ver, "*")==0)
+    return 1;
+ v=strtol(ver, &end, 10);
+ if (end==ver)
+    return 0;
+ if (*end=='+')
+    return kicad>=v;
+ return kicad==v;
+}
+
+static int remap_kind(const char *widget)
 {
- static void (*next_func)(Display *, GLXDrawable)=NULL;
- static int cnt=0;
+ if (strcmp(widget, "button")==0)
+    return REMAP_BUTTON;
+ if (strcmp(widget, "label")==0)
+    return REMAP_LABEL;
+ if (strcmp(widget, "dialog")==0)
+    return REMAP_DIALOG;
+ return -1;
+}
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping GLX\n");
-    next_func=dlsym(RTLD_NEXT,"glXSwapBuffers");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
+static void remap_load(const char *fn, int kicad)
+{
+ gchar *content, **lines, **l, **f;
+ int kind, n=0, len;
 
- next_func(dpy, drawable);
- printf("GLX:Swap %d\n", cnt++);
- fflush(stdout);
+ if (fn==NULL || !fn[0])
+    return;
+ content=load_file(fn);
+ if (content==NULL)
+    return;
+ lines=g_strsplit(content, "\n", -1);
+ free(content);
+ for (l=lines; *l; l++)
+    {
+     if ((*l)[0]=='#' || !(*l)[0])
+        continue;
+     f=g_strsplit(*l, "|", 4);
+     if (!f[0] || !f[1] || !f[2] || !f[3] || (kind=remap_kind(f[1]))<0)
+        ev_sendf(EV_INFO, "Malformed remap rule: %s", *l);
+     else if (remap_version_ok(f[0], kicad))
+       {
+        len=strlen(f[2]);
+        if (len && f[2][len-1]=='*')
+          {
+           if (remaps[kind].n_prefixes<MAX_REMAP_PREFIXES)
+             {
+              int i=remaps[kind].n_prefixes++;
+              remaps[kind].prefix[i]=g_strndup(f[2], len-1);
+              remaps[kind].prefix_len[i]=len-1;
+              remaps[kind].prefix_new[i]=g_strdup(f[3]);
+             }
+           else
+              ev_sendf(EV_INFO, "Too many remap prefixes, ignoring: %s", *l);
+          }
+        else
+           g_hash_table_insert(remaps[kind].exact, g_strdup(f[2]), g_strdup(f[3]));
+        n++;
+       }
+     g_strfreev(f);
+    }
+ g_strfreev(lines);
+ ev_sendf(EV_INFO, "Loaded %d rules from %s for KiCad %d", n, fn, kicad);
 }
 
-#define MAX_STORE 1024
+static void remap_init(void)
+{
+ const char *ver;
+ int kicad, i;
+
+ ver=getenv("KIAUTO_INTERPOSER_KICAD");
+ kicad=ver ? atoi(ver) : 0;
+ for (i=0; i<REMAP_KINDS; i++)
+     remaps[i].exact=g_hash_table_new(g_str_hash, g_str_equal);
+ remap_load(getenv("KIAUTO_INTERPOSER_REMAP"), kicad);
+ remap_load(getenv("KIAUTO_INTERPOSER_DIALOGS"), kicad);
+}
 
-void pango_layout_set_text(PangoLayout *layout, const char *text, int length)
+static const char *remap(int kind, const char *text)
 {
- static void (*next_func)(PangoLayout *, const char *, int)=NULL;
- static char buffer[MAX_STORE];
+ const char *res;
+ int i;
+
+ if (text==NULL || remaps[kind].exact==NULL)
+    return text;
+ res=g_hash_table_lookup(remaps[kind].exact, text);
+ if (res)
+    return res;
+ for (i=0; i<remaps[kind].n_prefixes; i++)
+     if (strncmp(text, remaps[kind].prefix[i], remaps[kind].prefix_len[i])==0)
+        return remaps[kind].prefix_new[i];
+ return text;
+}
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping PANGO\n");
-    next_func=dlsym(RTLD_NEXT,"pango_layout_set_text");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    buffer[0]=0;
-   }
 
- /* Filter what we log */
- if (text[0]!=0 &&  /* Emty strings??!! */
-     !(text[0]=='g' && text[1]==0) &&   /* g seems to be used to meassure */
-     !(text[0]=='.' && text[1]=='.' && text[2]=='.' && text[3]==0) &&
-     !(text[0]==(char)0xE2 && text[1]==(char)0x97 && text[2]==(char)0x8F && text[3]==0) &&  /* Ball 1 */
-     !(text[0]==(char)0xE2 && text[1]==(char)0x80 && text[2]==(char)0xA2 && text[3]==0) &&  /* Ball 2 */
-     strcmp(text, "ABCDEFHXfgkj"))  /* To meassure? */
-   {/* Avoid repetition */
-    if (strncmp(text, buffer, MAX_STORE))  /* Most stuff is sent 3 times!!! */
+/****************************************************************************
+ Dialogs answered by the interposer
+ The policy maps a dialog title to the label of the button we press, an
+ empty label means we just close the dialog (like Escape).
+ GTK dialogs (gtk_dialog_run) get the response without being displayed,
+ wxWidgets dialogs get the button clicked as soon as the main loop is idle.
+ The dialog texts are reported as: TITLE|BUTTON|TEXT1|TEXT2...
+****************************************************************************/
+struct dialog_scan
+{
+ const char *button;
+ GtkWidget *found;
+ GString *texts;
+};
+
+static const char *dialog_policy(const char *title)
+{
+ const char *res=remap(REMAP_DIALOG, title);
+ return res==title ? NULL : res;
+}
+
+/* Compares a button label, the mnemonics are ignored */
+static int dialog_label_eq(const char *label, const char *button)
+{
+ for (;; label++, button++)
+    {
+     while (*label=='_')
+        label++;
+     while (*button=='_')
+        button++;
+     if (*label!=*button)
+        return 0;
+     if (!*label)
+        return 1;
+    }
+}
+
+static void dialog_scan(GtkWidget *w, gpointer data)
+{
+ struct dialog_scan *d=data;
+ const gchar *text;
+
+ if (GTK_IS_BUTTON(w))
+   {
+    text=gtk_button_get_label(GTK_BUTTON(w));
+    if (d->found==NULL && d->button[0] && text && dialog_label_eq(text, d->button))
+       d->found=w;
+    return;
+   }
+ if (GTK_IS_LABEL(w))
+   {
+    text=gtk_label_get_text(GTK_LABEL(w));
+    if (text && text[0])
       {
-       fputs("PANGO:", stdout);
-       fputs(text, stdout);
-       fputc('\n', stdout);
-       fflush(stdout);
+       g_string_append_c(d->texts, '|');
+       g_string_append(d->texts, text);
       }
-    strncpy(buffer, text, MAX_STORE);
    }
- return next_func(layout, text, length);
+ else if (GTK_IS_CONTAINER(w))
+    gtk_container_forall(GTK_CONTAINER(w), dialog_scan, d);
 }
 
-
-void gtk_window_set_title(GtkWindow *window, const gchar *title)
+/* Reports the dialog and answers it. When response isn't NULL we just compute it (gtk_dialog_run) */
+static int dialog_answer(GtkWidget *win, const char *title, const char *button, gint *response)
 {
- static void (*next_func)(GtkWindow *window, const gchar *title)=NULL;
+ struct dialog_scan d={ button, NULL, NULL };
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping window title change\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_window_set_title");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
+ d.texts=g_string_new(title);
+ g_string_append_c(d.texts, '|');
+ g_string_append(d.texts, button);
+ gtk_container_forall(GTK_CONTAINER(win), dialog_scan, &d);
+ if (button[0] && d.found==NULL)
+   {
+    ev_sendf(EV_INFO, "No `%s` button in the `%s` dialog", button, title);
+    g_string_free(d.texts, TRUE);
+    return 0;
    }
-
- next_func(window, title);
- printf("GTK:Window Title:%s\n", title);
- fflush(stdout);
+ ev_send(EV_DIALOG_AUTO, d.texts->str, 0);
+ g_string_free(d.texts, TRUE);
+ if (response)
+    *response=d.found ? gtk_dialog_get_response_for_widget(GTK_DIALOG(win), d.found) : GTK_RESPONSE_DELETE_EVENT;
+ else if (d.found)
+    gtk_button_clicked(GTK_BUTTON(d.found));
+ else
+    gtk_window_close(GTK_WINDOW(win));
+ return 1;
 }
 
+static gboolean dialog_idle(gpointer data)
+{
+ GtkWidget *win=data;
+ const char *title, *button;
+
+ title=gtk_window_get_title(GTK_WINDOW(win));
+ /* Still there? */
+ if (title && gtk_widget_get_visible(win) && (button=dialog_policy(title))!=NULL)
+    dialog_answer(win, title, button, NULL);
+ g_object_unref(win);
+ return FALSE;
+}
 
-void gtk_window_set_modal(GtkWindow* window, gboolean modal)
+INTERPOSED gint gtk_dialog_run(GtkDialog *dialog)
 {
- static void (*next_func)(GtkWindow* window, gboolean modal)=NULL;
+ gint (*next_func)(GtkDialog *)=hk_next(HK_GTK_DIALOG_RUN);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ const char *title, *button;
+ gint res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping set modal\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_window_set_modal");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
+ title=gtk_window_get_title(GTK_WINDOW(dialog));
+ if (title && (button=dialog_policy(title))!=NULL && dialog_answer(GTK_WIDGET(dialog), title, button, &res))
+   {
+    st_add(HK_GTK_DIALOG_RUN, t0, t1, t2);
+    return res;
    }
-
- next_func(window, modal);
- printf("GTK:Window Set Modal:%s %d\n", gtk_window_get_title(window), modal);
- fflush(stdout);
+ t1=st_now();
+ res=next_func(dialog);
+ t2=st_now();
+ st_add(HK_GTK_DIALOG_RUN, t0, t1, t2);
+ return res;
 }
 
 
-void gtk_widget_show(GtkWidget* widget)
+INTERPOSED void gtk_widget_show(GtkWidget* widget)
 {
- static void (*next_func)(GtkWidget* widget)=NULL;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping widget show\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_widget_show");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
+ void (*next_func)(GtkWidget* widget)=hk_next(HK_GTK_WIDGET_SHOW);
+ uint64_t t0=st_now(), t1=0, t2=0;
 
+ t1=st_now();
  next_func(widget);
+ t2=st_now();
  if (GTK_IS_WINDOW(widget))
-    printf("GTK:Window Show:%s\n", gtk_window_get_title(GTK_WINDOW(widget)));
+   {
+    const char *title=gtk_window_get_title(GTK_WINDOW(widget));
+    ev_send(EV_WIN_SHOW, title, 0);
+    sp_mark("Show", title, t2);
+    if (title && dialog_policy(title))
+       /* Answer it once the dialog is running */
+       g_idle_add(dialog_idle, g_object_ref(widget));
+   }
  /*else
     printf("GTK:Window Show:Widget:%s\n", gtk_widget_get_name(widget));*/
- fflush(stdout);
+ st_add(HK_GTK_WIDGET_SHOW, t0, t1, t2);
 }
 
 
-void gtk_button_set_label(GtkButton* button, const char *label)
+#if HOOK_LABEL
+INTERPOSED void gtk_button_set_label(GtkButton* button, const char *label)
 {
- static void (*next_func)(GtkButton* button, const char *label)=NULL;
+ void (*next_func)(GtkButton* button, const char *label)=hk_next(HK_GTK_BUTTON_SET_LABEL);
+ uint64_t t0=st_now(), t1=0, t2=0;
  const char *ori=label;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping button label\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_button_set_label");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
-
- /* ACEGLP */
- if (g_strcmp0(label, "Print")==0)
-    /* Why KiCad people hates shortcuts? */
-    label="_Print";
- else if (label[0]=='S' && label[1]=='a' && label[2]=='v' && label[3]=='e')
-    label="_Save";
- else if (g_strcmp0(label, "Plot Current Page")==0)
-    label="Plot _Current Page";
- else if (g_strcmp0(label, "Plot All Pages")==0)
-    label="Plot _All Pages";
- else if (g_strcmp0(label, "Generate Netlist")==0 || g_strcmp0(label, "Export Netlist")==0)
-    label="_Export Netlist";
- else if (g_strcmp0(label, "Close")==0)
-    label="C_lose";
- else if (g_strcmp0(label, "Generate")==0)
-    label="_Generate";
+ label=remap(REMAP_BUTTON, label);
+ t1=st_now();
  next_func(button, label);
- printf("GTK:Button Label:%s\n", label);
+ t2=st_now();
+ ev_send(EV_BUTTON_LABEL, label, 0);
  if (label!=ori)
-    printf("GTK:Button Label:**Changed from %s\n", ori);
- fflush(stdout);
+    ev_send(EV_BUTTON_CHANGED, ori, 0);
+ st_add(HK_GTK_BUTTON_SET_LABEL, t0, t1, t2);
 }
+#endif /* HOOK_LABEL */
 
-gchar *dir_name="/tmp";
-gchar *base_name="pp";
-gchar *format="pdf";
+#if HOOK_PRINT
+static gchar *dir_name=NULL;
+static gchar *base_name=NULL;
+static gchar *format=NULL;
+
+static void set_print_option(gchar **opt, const gchar *val, const char *def, const char *name)
+{
+ g_free(*opt);
+ *opt=g_strdup(val && val[0] ? val : def);
+ ev_sendf(EV_READ, "%s:%s", name, *opt);
+}
 
 /*
-  Loads the print options from a file named "interposer_options.txt". I.e:
+  Loads the print options from the file indicated by KIAUTO_INTERPOSER_PRINT. I.e:
 /tmp
 pp
 pdf
+  The file is read for each print operation, so a KiCad session can print more than one output.
 */
-void load_print_options()
+static void load_print_options()
 {
- GIOChannel *f;
- gchar *line;
- gsize length, terminator_pos;
+ gchar *content=NULL, **lines=NULL;
+ guint n=0;
  char *fn;
 
  fn=getenv("KIAUTO_INTERPOSER_PRINT");
  if (fn==NULL)
+    ev_send(EV_ERROR, "KIAUTO_INTERPOSER_PRINT not defined", 0);
+ else if ((content=load_file(fn))==NULL)
+    ev_sendf(EV_ERROR, "Unable to load %s", fn);
+ else
    {
-    printf("GTK:Error:KIAUTO_INTERPOSER_PRINT not defined\n");
-    return;
-   }
- printf("GTK:Read:Dir_Name:%s\n", dir_name);
- f=g_io_channel_new_file(fn, "r", NULL);
- if (f==NULL)
-   {
-    printf("GTK:Error:Unable to load %s\n", fn);
-    return;
+    lines=g_strsplit(content, "\n", 4);
+    n=g_strv_length(lines);
    }
- g_io_channel_read_line(f, &dir_name, &length, &terminator_pos, NULL);
- dir_name[terminator_pos]=0;
- printf("GTK:Read:Dir_Name:%s\n", dir_name);
- g_io_channel_read_line(f, &base_name, &length, &terminator_pos, NULL);
- base_name[terminator_pos]=0;
- printf("GTK:Read:Base_Name:%s\n", base_name);
- g_io_channel_read_line(f, &format, &length, &terminator_pos, NULL);
- format[terminator_pos]=0;
- printf("GTK:Read:Format:%s\n", format);
- g_io_channel_unref(f);
+ /* Missing lines keep the defaults */
+ set_print_option(&dir_name, n>0 ? lines[0] : NULL, "/tmp", "Dir_Name");
+ set_print_option(&base_name, n>1 ? lines[1] : NULL, "pp", "Base_Name");
+ set_print_option(&format, n>2 ? lines[2] : NULL, "pdf", "Format");
+ g_strfreev(lines);
+ free(content);
 }
 
 
 /*
   Forces the GTK print dialog to select the output file, format and printer we want
 */
-GtkPrintOperationResult gtk_print_operation_run(GtkPrintOperation* op, GtkPrintOperationAction action, GtkWindow* parent, GError** error)
+INTERPOSED GtkPrintOperationResult gtk_print_operation_run(GtkPrintOperation* op, GtkPrintOperationAction action, GtkWindow* parent, GError** error)
 {
- static GtkPrintOperationResult (*next_func)(GtkPrintOperation* , GtkPrintOperationAction , GtkWindow* , GError** )=NULL;
+ GtkPrintOperationResult (*next_func)(GtkPrintOperation* , GtkPrintOperationAction , GtkWindow* , GError** )=hk_next(HK_GTK_PRINT_OPERATION_RUN);
+ uint64_t t0=st_now(), t1=0, t2=0;
  GtkPrintOperationResult res;
  GtkPrintSettings *print_sets;
  GtkSettings *gtk_sets;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping print op run\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_print_operation_run");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    load_print_options();
-   }
+ load_print_options();
 
  print_sets = gtk_print_operation_get_print_settings(op);
  /* Select the file format and name */
@@ -253,337 +1746,752 @@ GtkPrintOperationResult gtk_print_operation_run(GtkPrintOperation* op, GtkPrintO
  g_object_set(gtk_sets, "gtk-print-backends", "file", NULL);
 
  /* Now run the dialog. Lamentably GTK_PRINT_OPERATION_ACTION_PRINT can't be used. IMHO a bug */
+ t1=st_now();
  res = next_func(op, action, parent, error);
- printf("GTK:Print Run:%s\n", gtk_window_get_title(parent));
+ t2=st_now();
+ ev_send(EV_PRINT_RUN, gtk_window_get_title(parent), 0);
 
- fflush(stdout);
+ st_add(HK_GTK_PRINT_OPERATION_RUN, t0, t1, t2);
  return res;
 }
+#endif /* HOOK_PRINT */
 
 
-void gtk_label_set_text_with_mnemonic(GtkLabel *label, const gchar *str)
+#if HOOK_LABEL
+INTERPOSED void gtk_label_set_text_with_mnemonic(GtkLabel *label, const gchar *str)
 {
- static void (*next_func)(GtkLabel *label, const gchar *str)=NULL;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping label set text\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_label_set_text_with_mnemonic");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
+ void (*next_func)(GtkLabel *label, const gchar *str)=hk_next(HK_GTK_LABEL_SET_TEXT_WITH_MNEMONIC);
+ uint64_t t0=st_now(), t1=0, t2=0;
 
  /* Create some accelerators to make the navigation easier */
-  /* DRC Control dialog */
- if (g_strcmp0(str, "Report all errors for tracks (slower)")==0)
-    str="_Report all errors for tracks (slower)";
- else if (g_strcmp0(str, "Create report file:")==0)
-    str="_Create report file:";
-  /* GenCad export dialog */
- else if (g_strcmp0(str, "Flip bottom footprint padstacks")==0)
-    str="_Flip bottom footprint padstacks";
- else if (g_strcmp0(str, "Generate unique pin names")==0)
-    str="_Generate unique pin names";
- else if (g_strcmp0(str, "Generate a new shape for each footprint instance (do not reuse shapes)")==0)
-    str="Generate a _new shape for each footprint instance (do not reuse shapes)";
- else if (g_strcmp0(str, "Use drill/place file origin as origin")==0 ||
-          g_strcmp0(str, "Use auxiliary axis as origin")==0)  /* KiCad 5 version */
-    str="_Use drill/place file origin as origin";
- else if (g_strcmp0(str, "Save the origin coordinates in the file")==0)
-    str="_Save the origin coordinates in the file";
-  /* File menu */
- else if (g_strcmp0(str, "Export")==0)
-    str="E_xport";
- else if (g_strcmp0(str, "GenCAD...")==0)
-    str="_GenCAD...";
- else if (g_strcmp0(str, "IPC-D-356 Netlist File...")==0)
-    str="_IPC-D-356 Netlist File...";
-  /* EEschema Plot Schematic Options */
- else if (g_strcmp0(str, "Output directory:")==0)
-    str="_Output directory:";
-  /* EEschema Bill of Material */
- else if (g_strcmp0(str, "Command line running the generator:")==0)
-    str="C_ommand line running the generator:";
- else if (g_strcmp0(str, "Command line:")==0)
-    str="C_ommand line:";
-  /* EEschema Electrical Rules Checker */
- else if (g_strcmp0(str, "Create ERC file report")==0)
-    str="_Create ERC file report";
+ str=remap(REMAP_LABEL, str);
 
+ t1=st_now();
  next_func(label, str);
+ t2=st_now();
 
- printf("GTK:Label Set Text 2:%s\n", str);
- fflush(stdout);
+ ev_send(EV_LABEL_TEXT, str, 0);
+ st_add(HK_GTK_LABEL_SET_TEXT_WITH_MNEMONIC, t0, t1, t2);
 }
+#endif /* HOOK_LABEL */
 
 
-gchar *gtk_file_chooser_get_filename(GtkFileChooser *chooser)
+/*
+  Progress bars (i.e. wxProgressDialog used to load the PCB and fill the zones).
+  "GTK:Progress:TITLE PERCENT", TITLE is the title of the window containing the
+  bar (the phase). Only sent when the percent changes, KiCad updates the bars
+  much more often. The windows are marked, so we can send "GTK:Progress End:TITLE"
+  when they are destroyed.
+*/
+static GQuark progress_last, progress_window;
+
+static void progress_init(void)
 {
- static gchar *(*next_func)(GtkFileChooser *)=NULL;
- static char *fn;
- gchar *res;
+ progress_last=g_quark_from_static_string("kiauto-progress-last");
+ progress_window=g_quark_from_static_string("kiauto-progress-window");
+}
+
+INTERPOSED void gtk_progress_bar_set_fraction(GtkProgressBar *pbar, gdouble fraction)
+{
+ void (*next_func)(GtkProgressBar *pbar, gdouble fraction)=hk_next(HK_GTK_PROGRESS_BAR_SET_FRACTION);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ GtkWidget *top;
+ int pct;
+
+ t1=st_now();
+ next_func(pbar, fraction);
+ t2=st_now();
+
+ pct=fraction<=0 ? 0 : (fraction>=1 ? 100 : (int)(fraction*100));
+ /* Stored +1, NULL is a new bar */
+ if (GPOINTER_TO_INT(g_object_get_qdata(G_OBJECT(pbar), progress_last))!=pct+1)
+   {
+    g_object_set_qdata(G_OBJECT(pbar), progress_last, GINT_TO_POINTER(pct+1));
+    top=gtk_widget_get_toplevel(GTK_WIDGET(pbar));
+    if (GTK_IS_WINDOW(top))
+      {
+       const char *title=gtk_window_get_title(GTK_WINDOW(top));
+       g_object_set_qdata(G_OBJECT(top), progress_window, GINT_TO_POINTER(1));
+       ev_send(EV_PROGRESS, title ? title : "", pct);
+      }
+   }
+ st_add(HK_GTK_PROGRESS_BAR_SET_FRACTION, t0, t1, t2);
+}
+
+
+/*
+  Replaces the name selected in the file choosers.
+  KIAUTO_INTERPOSER_FILENAME is the name, KIAUTO_INTERPOSER_FILENAME_FILE is a
+  file containing a queue of names, one per line. Each file chooser takes the
+  first name and removes it from the file, the last one is kept for the rest.
+  The file is read for each new chooser, so the names can be changed while
+  KiCad is running (worker mode).
+*/
+static GtkFileChooser *fc_last=NULL;
+static gchar *fc_name=NULL;
+static const char *fc_env_name, *fc_env_file;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping file chooser get filename\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_file_chooser_get_filename");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    fn=getenv("KIAUTO_INTERPOSER_FILENAME");
-    if (fn==NULL)
-       printf("****** NOT DEFINED\n");
+static void fc_init(void)
+{
+ fc_env_name=getenv("KIAUTO_INTERPOSER_FILENAME");
+ fc_env_file=getenv("KIAUTO_INTERPOSER_FILENAME_FILE");
+ if (fc_env_name==NULL && fc_env_file==NULL)
+    ev_send(EV_INFO, "***** NOT DEFINED", 0);
+}
+
+static void fc_next_name(const char *fn_file)
+{
+ gchar *content, *rest;
+
+ if ((content=load_file(fn_file))==NULL)
+    return;
+ g_free(fc_name);
+ fc_name=NULL;
+ rest=strchr(content, '\n');
+ if (rest)
+   {
+    *rest=0;
+    /* Consume it, unless is the last */
+    if (rest[1])
+       save_file(fn_file, rest+1);
    }
+ if (content[0])
+    fc_name=g_strdup(content);
+ free(content);
+}
 
+INTERPOSED gchar *gtk_file_chooser_get_filename(GtkFileChooser *chooser)
+{
+ gchar *(*next_func)(GtkFileChooser *)=hk_next(HK_GTK_FILE_CHOOSER_GET_FILENAME);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ gchar *res;
+
+ t1=st_now();
  res=next_func(chooser);
+ t2=st_now();
 
- if (fn!=NULL)
+ /* KiCad asks more than once for the same chooser */
+ if (fc_env_file!=NULL && chooser!=fc_last)
+   {
+    fc_next_name(fc_env_file);
+    fc_last=chooser;
+   }
+ if (fc_env_file!=NULL && fc_name!=NULL)
+   {
+    ev_send(EV_FILENAME, fc_name, 0);
+    ev_send(EV_FILENAME_CHANGED, res, 0);
+    res=g_strdup(fc_name);
+   }
+ else if (fc_env_name!=NULL)
    {
-    printf("GTK:Filename:%s\n", fn);
-    printf("GTK:Filename:**Changed from %s\n",res);
-    res=g_strdup(fn);
+    ev_send(EV_FILENAME, fc_env_name, 0);
+    ev_send(EV_FILENAME_CHANGED, res, 0);
+    res=g_strdup(fc_env_name);
    }
  else
    {
-    printf("GTK:Filename:%s\n", res);
+    ev_send(EV_FILENAME, res, 0);
    }
- fflush(stdout);
+ st_add(HK_GTK_FILE_CHOOSER_GET_FILENAME, t0, t1, t2);
  return res;
 }
 
 
-FILE *fopen64(const char *filename, const char *mode)
+#if HOOK_IO
+/****************************************************************************
+ Paths of the file descriptors we saw opened
+ The close wrappers use it to know the name of the file, no need to ask the
+ kernel. Descriptors not found here weren't opened using our wrappers
+ (sockets, pipes, etc.) or aren't in the watch list, so they aren't reported.
+ Only the files opened for writing are reported as complete when closed.
+ The name stored is the one used by the kernel (/proc/self/fd, symlinks
+ resolved). When watching everything only for the files opened for writing.
+****************************************************************************/
+#define MAX_FDS 4096
+/* We can't include fcntl.h, it declares open() using a different prototype */
+#define FD_AT_CWD -100
+#define FD_O_WRITE 0103  /* O_WRONLY|O_RDWR|O_CREAT */
+struct fd_info
 {
- static FILE *(*next_func)(const char *, const char *)=NULL;
- FILE *res;
+ int write;
+ char path[];
+};
+static struct fd_info *fd_paths[MAX_FDS];
+/* Low level I/O (open and close) is also logged */
+static int io_log=FORCE_LOW_LEVEL_LOG;
+
+static void io_log_init(void)
+{
+ const char *fn=getenv("KIAUTO_INTERPOSER_LOWLEVEL_IO");
+
+ if ((fn==NULL || !fn[0]) && !FORCE_LOW_LEVEL_LOG)
+    ev_send(EV_INFO, "Not logging low level I/O", 0);
+ else
+    io_log=1;
+}
+
+/* Returns an allocated absolute version of the path, like the kernel reports it */
+static char *io_full_path(int dirfd, const char *path)
+{
+ char *full, *dir=NULL, cwd[1024];
+ struct fd_info *d;
+
+ if (path[0]!='/')
+   {
+    if (dirfd==FD_AT_CWD)
+       dir=getcwd(cwd, sizeof(cwd));
+    else if (dirfd>=0 && dirfd<MAX_FDS && (d=__atomic_load_n(&fd_paths[dirfd], __ATOMIC_ACQUIRE))!=NULL)
+       dir=d->path;
+   }
+ if (!dir)
+    return strdup(path);
+ full=malloc(strlen(dir)+strlen(path)+2);
+ if (full)
+    sprintf(full, "%s/%s", dir, path);
+ return full;
+}
+
+/* The name of an open file used by the kernel, NULL if not available */
+static char *fd_real_path(int fd)
+{
+ char link[32], buf[4096];
+ ssize_t len;
+
+ snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+ len=readlink(link, buf, sizeof(buf)-1);
+ if (len<=0)
+    return NULL;
+ buf[len]=0;
+ return strdup(buf);
+}
+
+/* Returns the path and mode (must be released) or NULL if we didn't see it opened */
+static struct fd_info *fd_take_path(int fd)
+{
+ if (fd<0 || fd>=MAX_FDS)
+    return NULL;
+ return __atomic_exchange_n(&fd_paths[fd], NULL, __ATOMIC_ACQ_REL);
+}
+
+/****************************************************************************
+ Watch list for the I/O events
+ KiAuto just needs to know about the files it asked KiCad to create, so we
+ avoid reporting all the libraries, icons, fonts, etc.
+ The list comes from KIAUTO_INTERPOSER_WATCH (separated by :) and/or
+ KIAUTO_INTERPOSER_WATCH_FILE (one per line). Each entry can be:
+ /exact/path
+ /a/directory/   (trailing slash, any file inside it)
+ *.ext           (any file using this extension)
+ *               (everything, the default when no list is defined)
+****************************************************************************/
+#define MAX_WATCH_DIRS 32
+static int watch_all=1;
+static GHashTable *watch_exact;
+/* File names of the exact entries, to discard the relative names */
+static GHashTable *watch_base;
+static GHashTable *watch_ext;
+static char *watch_dirs[MAX_WATCH_DIRS];
+static int watch_dirs_len[MAX_WATCH_DIRS];
+static int watch_n_dirs=0;
+
+static void watch_add(gchar **entries)
+{
+ gchar **e;
+ int len;
+
+ for (e=entries; *e; e++)
+    {
+     g_strstrip(*e);
+     len=strlen(*e);
+     if (!len)
+        continue;
+     watch_all=0;
+     if (strcmp(*e, "*")==0)
+        watch_all=-1;
+     else if ((*e)[0]=='*' && (*e)[1]=='.')
+        g_hash_table_insert(watch_ext, g_strdup(*e+2), GINT_TO_POINTER(1));
+     else if ((*e)[len-1]=='/')
+       {
+        if (watch_n_dirs<MAX_WATCH_DIRS)
+          {
+           watch_dirs_len[watch_n_dirs]=len;
+           watch_dirs[watch_n_dirs++]=g_strdup(*e);
+          }
+        else
+           ev_sendf(EV_INFO, "Too many watched dirs, ignoring %s", *e);
+       }
+     else
+       {
+        const char *base=strrchr(*e, '/');
+        g_hash_table_insert(watch_exact, g_strdup(*e), GINT_TO_POINTER(1));
+        g_hash_table_insert(watch_base, g_strdup(base ? base+1 : *e), GINT_TO_POINTER(1));
+       }
+    }
+}
+
+static void watch_init(void)
+{
+ const char *list, *fn;
+ gchar **entries;
+ gchar *content;
+
+ list=getenv("KIAUTO_INTERPOSER_WATCH");
+ fn=getenv("KIAUTO_INTERPOSER_WATCH_FILE");
+ if ((list==NULL || !list[0]) && (fn==NULL || !fn[0]))
+    return;
+ watch_exact=g_hash_table_new(g_str_hash, g_str_equal);
+ watch_base=g_hash_table_new(g_str_hash, g_str_equal);
+ watch_ext=g_hash_table_new(g_str_hash, g_str_equal);
+ if (list && list[0])
+   {
+    entries=g_strsplit(list, ":", -1);
+    watch_add(entries);
+    g_strfreev(entries);
+   }
+ if (fn && fn[0] && (content=load_file(fn))!=NULL)
+   {
+    entries=g_strsplit(content, "\n", -1);
+    watch_add(entries);
+    g_strfreev(entries);
+    free(content);
+   }
+ if (watch_all<0)
+    watch_all=1;
+ if (!watch_all)
+    ev_sendf(EV_INFO, "Watching %d files, %d dirs and %d extensions", g_hash_table_size(watch_exact),
+             watch_n_dirs, g_hash_table_size(watch_ext));
+}
+
+static int watch_match_ext(const char *path)
+{
+ const char *ext=strrchr(path, '.');
+
+ return ext && !strchr(ext, '/') && g_hash_table_lookup(watch_ext, ext+1);
+}
+
+/* path must be absolute */
+static int watch_match(const char *path)
+{
+ int i;
+
+ if (watch_all)
+    return 1;
+ if (g_hash_table_lookup(watch_exact, path) || watch_match_ext(path))
+    return 1;
+ for (i=0; i<watch_n_dirs; i++)
+     if (strncmp(path, watch_dirs[i], watch_dirs_len[i])==0)
+        return 1;
+ return 0;
+}
+
+/* Ckecks the name as it was used, 0 if it can't be watched. So we only make the full path for the candidates. */
+static int watch_maybe(const char *path)
+{
+ const char *base;
+
+ if (watch_all)
+    return 1;
+ if (path[0]=='/')
+    return watch_match(path);
+ /* Relative names inside a watched dir need the full path */
+ if (watch_n_dirs || watch_match_ext(path))
+    return 1;
+ base=strrchr(path, '/');
+ return g_hash_table_lookup(watch_base, base ? base+1 : path)!=NULL;
+}
+
+/* Reports a file we consider finished (closed or renamed into place) and its size, -1 if it doesn't exist */
+static void io_complete(const char *path)
+{
+ struct stat st;
+ int size=-1;
+
+ if (stat(path, &st)==0)
+    size=st.st_size>0x7FFFFFFF ? 0x7FFFFFFF : (int)st.st_size;
+ ev_send(EV_IO_COMPLETE, path, size);
+}
+
+/* Reports an open, if watched, and remembers the path for the close */
+static void io_opened(int fd, int dirfd, const char *pathname, int write, int kind, const char *text, int arg)
+{
+ char *full, *real;
+ struct fd_info *info, *old;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping fopen64\n");
-    next_func=dlsym(RTLD_NEXT,"fopen64");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
+ /* Most of the files aren't watched, discard them without making the full name */
+ if (pathname==NULL || !watch_maybe(pathname))
+    return;
+ if (pathname[0]=='/')
+    full=strdup(pathname);
+ else
+   {
+    full=io_full_path(dirfd, pathname);
+    if (full && !watch_match(full))
+      {
+       free(full);
+       return;
+      }
+   }
+ if (full==NULL)
+    return;
+ ev_send(EV_IO_OPEN, pathname, 0);
+ if (ALL_OPEN_MODES)
+    ev_send(kind, text, arg);
+ if (fd<0 || fd>=MAX_FDS)
+   {
+    free(full);
+    return;
+   }
+ if ((!watch_all || write) && (real=fd_real_path(fd))!=NULL)
+   {
+    free(full);
+    full=real;
    }
+ info=malloc(sizeof(*info)+strlen(full)+1);
+ if (info)
+   {
+    info->write=write;
+    strcpy(info->path, full);
+   }
+ free(full);
+ old=__atomic_exchange_n(&fd_paths[fd], info, __ATOMIC_ACQ_REL);
+ free(old);
+}
+#endif /* HOOK_IO */
+
 
+/* Called before KiCad's main */
+__attribute__((constructor)) static void interposer_init(void)
+{
+ /* The ring always has them */
+ ev_stamps=getenv("KIAUTO_INTERPOSER_TIMESTAMPS")!=NULL;
+ stats_init();
+ sp_init();
+ ring_init();
+ if (!ring_hdr)
+    tq_init();
+ hk_init();
+ pango_init();
+ progress_init();
+ fc_init();
+#if HOOK_IO
+ io_log_init();
+ watch_init();
+#endif
+ remap_init();
+}
+
+
+#if HOOK_IO
+INTERPOSED FILE *fopen64(const char *filename, const char *mode)
+{
+ FILE *(*next_func)(const char *, const char *)=hk_next(HK_FOPEN64);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ FILE *res;
+
+ t1=st_now();
  res=next_func(filename, mode);
+ t2=st_now();
 
  if (mode[0]=='w' || ALL_OPEN_MODES)
-    printf("IO:open:%s\n", filename);
-    if (ALL_OPEN_MODES)
-       printf("IO:fopen64:%s\n", mode);
- fflush(stdout);
+    io_opened(res ? fileno(res) : -1, FD_AT_CWD, filename, strpbrk(mode, "wa+")!=NULL, EV_IO_FOPEN64, mode, 0);
+ sp_open(FD_AT_CWD, filename, res==NULL, t1, t2);
+ st_add(HK_FOPEN64, t0, t1, t2);
  return res;
 }
 
 
-FILE *fopen(const char *filename, const char *mode)
+INTERPOSED FILE *fopen(const char *filename, const char *mode)
 {
- static FILE *(*next_func)(const char *, const char *)=NULL;
+ FILE *(*next_func)(const char *, const char *)=hk_next(HK_FOPEN);
+ uint64_t t0=st_now(), t1=0, t2=0;
  FILE *res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping fopen\n");
-    next_func=dlsym(RTLD_NEXT,"fopen");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
-
+ t1=st_now();
  res=next_func(filename, mode);
+ t2=st_now();
 
  if (mode[0]=='w' || ALL_OPEN_MODES)
-    printf("IO:open:%s\n", filename);
-    if (ALL_OPEN_MODES)
-       printf("IO:fopen:%s\n", mode);
- fflush(stdout);
+    io_opened(res ? fileno(res) : -1, FD_AT_CWD, filename, strpbrk(mode, "wa+")!=NULL, EV_IO_FOPEN, mode, 0);
+ sp_open(FD_AT_CWD, filename, res==NULL, t1, t2);
+ st_add(HK_FOPEN, t0, t1, t2);
  return res;
 }
 
 
-int fclose(FILE *stream)
+INTERPOSED int fclose(FILE *stream)
 {
- static int(*next_func)(FILE *)=NULL;
+ int(*next_func)(FILE *)=hk_next(HK_FCLOSE);
+ uint64_t t0=st_now(), t1=0, t2=0;
  int res;
- char path[1024];
- char result[1024];
- int fd;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping fclose\n");
-    next_func=dlsym(RTLD_NEXT,"fclose");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    printf("* next_func : %p\n", next_func);
-   }
-
- fd=fileno(stream);
- /* Read out the link to our file descriptor. */
- sprintf(path, "/proc/self/fd/%d", fd);
- memset(result, 0, 1024);
- readlink(path, result, 1023);
+ struct fd_info *info;
 
+ info=fd_take_path(fileno(stream));
+ t1=st_now();
  res=next_func(stream);
- printf("IO:close:%s\n",result);
- fflush(stdout);
+ t2=st_now();
+ if (info)
+   {
+    ev_send(EV_IO_CLOSE, info->path, 0);
+    if (info->write)
+       io_complete(info->path);
+    free(info);
+   }
+ st_add(HK_FCLOSE, t0, t1, t2);
  return res;
 }
+#endif /* HOOK_IO */
 
 
-void gtk_main(void)
+/****************************************************************************
+ Main loop state
+ We replace the poll function of the default GLib context. GLib calls it
+ with a timeout only when no source is ready, so the GUI thread is about
+ to block: KiCad is idle. When it returns KiCad is busy again.
+****************************************************************************/
+static GPollFunc next_poll=NULL;
+
+static gint idle_poll(GPollFD *ufds, guint nfds, gint timeout)
 {
- static void (*next_func)(void)=NULL;
+ gint res;
+
+ if (timeout==0)
+    /* Just checking, we are still busy */
+    return next_poll(ufds, nfds, timeout);
+ ev_send(EV_MAIN_IDLE, NULL, 0);
+ res=next_poll(ufds, nfds, timeout);
+ ev_send(EV_MAIN_BUSY, NULL, 0);
+ return res;
+}
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping gtk_main\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_main");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
+static void idle_hook_install(void)
+{
+ GMainContext *ctx=g_main_context_default();
 
- printf("GTK:Main:In\n");
- fflush(stdout);
- next_func();
- printf("GTK:Main:Out\n");
- fflush(stdout);
+ next_poll=g_main_context_get_poll_func(ctx);
+ if (next_poll==NULL)
+    return;
+ g_main_context_set_poll_func(ctx, idle_poll);
+ ev_send(EV_INFO, "hooked main loop poll", 0);
 }
 
 
-void gtk_widget_destroy(GtkWidget *widget)
+INTERPOSED void gtk_main(void)
 {
- static void (*next_func)(GtkWidget *)=NULL;
+ void (*next_func)(void)=hk_next(HK_GTK_MAIN);
+ uint64_t t0=st_now(), t1=0, t2=0;
+
+ if (next_poll==NULL)
+    idle_hook_install();
+ sp_finish("main");
+ ev_send(EV_MAIN_IN, NULL, 0);
+ t1=st_now();
+ next_func();
+ t2=st_now();
+ ev_send(EV_MAIN_OUT, NULL, 0);
+ st_add(HK_GTK_MAIN, t0, t1, t2);
+}
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping widget destroy\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_widget_destroy");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-   }
 
+INTERPOSED void gtk_widget_destroy(GtkWidget *widget)
+{
+ void (*next_func)(GtkWidget *)=hk_next(HK_GTK_WIDGET_DESTROY);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ int progress;
+
+ /* Read it while the window is alive */
+ progress=progress_window && GTK_IS_WINDOW(widget) && g_object_get_qdata(G_OBJECT(widget), progress_window);
+ /* The next file chooser could get the same address */
+ if (fc_last && (GTK_WIDGET(fc_last)==widget || gtk_widget_is_ancestor(GTK_WIDGET(fc_last), widget)))
+    fc_last=NULL;
+ t1=st_now();
  next_func(widget);
+ t2=st_now();
  if (GTK_IS_WINDOW(widget))
    {
     const char *name=gtk_window_get_title(GTK_WINDOW(widget));
     if (name)
-      {
-       printf("GTK:Window Destroy:%s\n", name);
-       fflush(stdout);
-      }
+       ev_send(EV_WIN_DESTROY, name, 0);
+    if (progress)
+       ev_send(EV_PROGRESS_END, name ? name : "", 0);
    }
+ st_add(HK_GTK_WIDGET_DESTROY, t0, t1, t2);
 }
 
 
-int open64(const char *pathname, int flags, mode_t mode)
+#if HOOK_IO
+INTERPOSED int open64(const char *pathname, int flags, mode_t mode)
 {
- static int (*next_func)(const char *, int , mode_t)=NULL;
- static int do_log=FORCE_LOW_LEVEL_LOG;
+ int (*next_func)(const char *, int , mode_t)=hk_next(HK_OPEN64);
+ uint64_t t0=st_now(), t1=0, t2=0;
  int res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    const char *fn;
-    printf("* wrapping open64\n");
-    next_func=dlsym(RTLD_NEXT,"open64");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    fn=getenv("KIAUTO_INTERPOSER_LOWLEVEL_IO");
-    if ((fn==NULL || !fn[0]) && !FORCE_LOW_LEVEL_LOG)
-       printf("* Not logging low level I/O\n");
-    else
-       do_log=1;
-   }
+ t1=st_now();
+ res=next_func(pathname, flags, mode);
+ t2=st_now();
+
+ if (io_log)
+    io_opened(res, FD_AT_CWD, pathname, (flags & FD_O_WRITE)!=0, EV_IO_OPEN64_MODE, NULL, mode);
+ sp_open(FD_AT_CWD, pathname, res<0, t1, t2);
+ st_add(HK_OPEN64, t0, t1, t2);
+ return res;
+}
+
+
+INTERPOSED int open(const char *pathname, int flags, mode_t mode)
+{
+ int (*next_func)(const char *, int , mode_t)=hk_next(HK_OPEN);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ int res;
 
+ t1=st_now();
  res=next_func(pathname, flags, mode);
+ t2=st_now();
 
- if (do_log)
-   {
-    printf("IO:open:%s\n", pathname);
-    if (ALL_OPEN_MODES)
-       printf("IO:open64:0x%X\n", mode);
-    fflush(stdout);
-   }
+ if (io_log)
+    io_opened(res, FD_AT_CWD, pathname, (flags & FD_O_WRITE)!=0, EV_IO_OPEN_MODE, NULL, mode);
+ sp_open(FD_AT_CWD, pathname, res<0, t1, t2);
+ st_add(HK_OPEN, t0, t1, t2);
  return res;
 }
 
 
-int open(const char *pathname, int flags, mode_t mode)
+INTERPOSED int openat64(int dirfd, const char *pathname, int flags, mode_t mode)
 {
- static int (*next_func)(const char *, int , mode_t)=NULL;
- static int do_log=FORCE_LOW_LEVEL_LOG;
+ int (*next_func)(int, const char *, int , mode_t)=hk_next(HK_OPENAT64);
+ uint64_t t0=st_now(), t1=0, t2=0;
  int res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    const char *fn;
-    printf("* wrapping open\n");
-    next_func=dlsym(RTLD_NEXT,"open");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    fn=getenv("KIAUTO_INTERPOSER_LOWLEVEL_IO");
-    if ((fn==NULL || !fn[0]) && !FORCE_LOW_LEVEL_LOG)
-       printf("* Not logging low level I/O\n");
-    else
-       do_log=1;
-   }
+ t1=st_now();
+ res=next_func(dirfd, pathname, flags, mode);
+ t2=st_now();
 
- res=next_func(pathname, flags, mode);
+ if (io_log)
+    io_opened(res, dirfd, pathname, (flags & FD_O_WRITE)!=0, EV_IO_OPENAT64_MODE, NULL, mode);
+ sp_open(dirfd, pathname, res<0, t1, t2);
+ st_add(HK_OPENAT64, t0, t1, t2);
+ return res;
+}
 
- if (do_log)
-   {
-    printf("IO:open:%s\n", pathname);
-    if (ALL_OPEN_MODES)
-       printf("IO:open:0x%X\n", mode);
-    fflush(stdout);
-   }
+
+INTERPOSED int openat(int dirfd, const char *pathname, int flags, mode_t mode)
+{
+ int (*next_func)(int, const char *, int , mode_t)=hk_next(HK_OPENAT);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ int res;
+
+ t1=st_now();
+ res=next_func(dirfd, pathname, flags, mode);
+ t2=st_now();
+
+ if (io_log)
+    io_opened(res, dirfd, pathname, (flags & FD_O_WRITE)!=0, EV_IO_OPENAT_MODE, NULL, mode);
+ sp_open(dirfd, pathname, res<0, t1, t2);
+ st_add(HK_OPENAT, t0, t1, t2);
  return res;
 }
 
 
-int close(int fd)
+INTERPOSED int close(int fd)
 {
- static int(*next_func)(int)=NULL;
- static int do_log=FORCE_LOW_LEVEL_LOG;
+ int(*next_func)(int)=hk_next(HK_CLOSE);
+ uint64_t t0=st_now(), t1=0, t2=0;
  int res;
- char path[1024];
- char result[1024];
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    const char *fn;
-    printf("* wrapping close\n");
-    next_func=dlsym(RTLD_NEXT,"close");
-    if ((msg=dlerror())!=NULL)
-       printf("* dlopen failed : %s\n", msg);
-    fn=getenv("KIAUTO_INTERPOSER_LOWLEVEL_IO");
-    if ((fn==NULL || !fn[0]) && !FORCE_LOW_LEVEL_LOG)
-       printf("* Not logging low level I/O\n");
-    else
-       do_log=1;
-   }
+ struct fd_info *info=NULL;
 
- if (do_log)
-   {/* Read out the link to our file descriptor. */
-    sprintf(path, "/proc/self/fd/%d", fd);
-    memset(result, 0, 1024);
-    readlink(path, result, 1023);
-   }
+ if (io_log)
+    info=fd_take_path(fd);
 
+ t1=st_now();
  res=next_func(fd);
- if (do_log)
+ t2=st_now();
+ if (info)
    {
-    printf("IO:close:%s\n",result);
-    fflush(stdout);
+    ev_send(EV_IO_CLOSE, info->path, 0);
+    if (info->write)
+       io_complete(info->path);
+    free(info);
+   }
+ st_add(HK_CLOSE, t0, t1, t2);
+ return res;
+}
+
+
+/*
+  Files saved using a temporal and then renamed into place (i.e. wxTempFile)
+  are never closed using the final name, we report them here.
+*/
+static void io_renamed(int dirfd, const char *newpath)
+{
+ char *full, *real;
+
+ if (!watch_maybe(newpath) || (full=io_full_path(dirfd, newpath))==NULL)
+    return;
+ if (watch_match(full))
+   {
+    /* Like the close, the name used by the kernel */
+    real=realpath(full, NULL);
+    io_complete(real ? real : full);
+    free(real);
    }
+ free(full);
+}
+
+
+INTERPOSED int rename(const char *oldpath, const char *newpath)
+{
+ int (*next_func)(const char *, const char *)=hk_next(HK_RENAME);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ int res;
+
+ t1=st_now();
+ res=next_func(oldpath, newpath);
+ t2=st_now();
+ if (res==0)
+    io_renamed(FD_AT_CWD, newpath);
+ st_add(HK_RENAME, t0, t1, t2);
+ return res;
+}
+
+
+INTERPOSED int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+ int (*next_func)(int, const char *, int, const char *)=hk_next(HK_RENAMEAT);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ int res;
+
+ t1=st_now();
+ res=next_func(olddirfd, oldpath, newdirfd, newpath);
+ t2=st_now();
+ if (res==0)
+    io_renamed(newdirfd, newpath);
+ st_add(HK_RENAMEAT, t0, t1, t2);
+ return res;
+}
+#endif /* HOOK_IO */
+
+
+#if HOOK_DLOPEN
+/****************************************************************************
+ Dynamic libraries
+ Only timed for the start-up profile. Note that dlopen uses the RUNPATH of
+ the caller, now us (we don't have one), so relative names could fail. Only
+ included in the start-up variant of the library (libinterposer-startup.so).
+****************************************************************************/
+INTERPOSED void *dlopen(const char *filename, int flags)
+{
+ void *(*next_func)(const char *, int)=hk_next(HK_DLOPEN);
+ uint64_t t0=st_now(), t1=0, t2=0;
+ void *res;
+
+ /* The constructors of the library can load others */
+ sp_depth++;
+ t1=st_now();
+ res=next_func(filename, flags);
+ t2=st_now();
+ sp_depth--;
+ if (t1)
+    sp_dlopen(filename, res!=NULL, t1, t2);
+ st_add(HK_DLOPEN, t0, t1, t2);
  return res;
 }
+#endif /* HOOK_DLOPEN */
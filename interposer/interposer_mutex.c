@@ -22,25 +22,71 @@
 
 static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
 
-void mutex_init()
+/****************************************************************************
+ Real functions
+ Resolved by the constructor, in a table indexed by the hook (HK_*), so the
+ wrappers just make an indirect call. Calls made before it (i.e. from the
+ constructors of the libraries we use) resolve the symbol on the fly, dlsym
+ always returns the same address, so the threads can do it at the same time.
+****************************************************************************/
+enum
+{
+ HK_GLXSWAPBUFFERS, HK_PANGO_LAYOUT_SET_TEXT, HK_GTK_WINDOW_SET_TITLE, HK_GTK_WINDOW_SET_MODAL,
+ HK_GTK_WIDGET_SHOW, HK_GTK_BUTTON_SET_LABEL, HK_GTK_PRINT_OPERATION_RUN, HK_GTK_LABEL_SET_TEXT_WITH_MNEMONIC,
+ HK_GTK_FILE_CHOOSER_GET_FILENAME, HK_FOPEN, HK_FOPEN64, HK_FCLOSE, HK_OPEN64, HK_CLOSE,
+ HK_COUNT
+};
+
+static const char *hk_names[HK_COUNT]=
+{
+ "glXSwapBuffers", "pango_layout_set_text", "gtk_window_set_title", "gtk_window_set_modal", "gtk_widget_show",
+ "gtk_button_set_label", "gtk_print_operation_run", "gtk_label_set_text_with_mnemonic",
+ "gtk_file_chooser_get_filename", "fopen", "fopen64", "fclose", "open64", "close"
+};
+
+static void *hk_real[HK_COUNT];
+
+static void *hk_resolve(int hook)
+{
+ void *f=dlsym(RTLD_NEXT, hk_names[hook]);
+
+ __atomic_store_n(&hk_real[hook], f, __ATOMIC_RELEASE);
+ return f;
+}
+
+static inline void *hk_next(int hook)
 {
+ void *f=__atomic_load_n(&hk_real[hook], __ATOMIC_ACQUIRE);
+
+ return f ? f : hk_resolve(hook);
+}
+
+/* Failed lookups are reported in one message */
+static void hk_init(void)
+{
+ int i, n=0, missing=0;
+
+ for (i=0; i<HK_COUNT; i++)
+    {
+     if (hk_real[i] || hk_resolve(i))
+        n++;
+     else
+       {
+        printf(missing ? " %s" : "** Unable to resolve: %s", hk_names[i]);
+        missing=1;
+       }
+    }
+ if (missing)
+    printf("\n");
+ printf("* Wrapping %d functions\n", n);
+ fflush(stdout);
 }
 
 void glXSwapBuffers(Display *dpy, GLXDrawable drawable)
 {
- static void (*next_func)(Display *, GLXDrawable)=NULL;
+ void (*next_func)(Display *, GLXDrawable)=hk_next(HK_GLXSWAPBUFFERS);
  static int cnt=0;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping GLX\n");
-    next_func=dlsym(RTLD_NEXT,"glXSwapBuffers");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  next_func(dpy, drawable);
 
  pthread_mutex_lock(&lock);
@@ -53,20 +99,9 @@ void glXSwapBuffers(Display *dpy, GLXDrawable drawable)
 
 void pango_layout_set_text(PangoLayout *layout, const char *text, int length)
 {
- static void (*next_func)(PangoLayout *, const char *, int)=NULL;
+ void (*next_func)(PangoLayout *, const char *, int)=hk_next(HK_PANGO_LAYOUT_SET_TEXT);
  static char buffer[MAX_STORE];
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping PANGO\n");
-    next_func=dlsym(RTLD_NEXT,"pango_layout_set_text");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-    buffer[0]=0;
-   }
-
  /* Filter what we log */
  if (text[0]!=0 &&  /* Emty strings??!! */
      !(text[0]=='g' && text[1]==0) &&   /* g seems to be used to meassure */
@@ -87,17 +122,7 @@ void pango_layout_set_text(PangoLayout *layout, const char *text, int length)
 
 void gtk_window_set_title(GtkWindow *window, const gchar *title)
 {
- static void (*next_func)(GtkWindow *window, const gchar *title)=NULL;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping window title change\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_window_set_title");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
+ void (*next_func)(GtkWindow *window, const gchar *title)=hk_next(HK_GTK_WINDOW_SET_TITLE);
 
  next_func(window, title);
 
@@ -110,17 +135,7 @@ void gtk_window_set_title(GtkWindow *window, const gchar *title)
 
 void gtk_window_set_modal(GtkWindow* window, gboolean modal)
 {
- static void (*next_func)(GtkWindow* window, gboolean modal)=NULL;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping set modal\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_window_set_modal");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
+ void (*next_func)(GtkWindow* window, gboolean modal)=hk_next(HK_GTK_WINDOW_SET_MODAL);
 
  next_func(window, modal);
 
@@ -133,17 +148,7 @@ void gtk_window_set_modal(GtkWindow* window, gboolean modal)
 
 void gtk_widget_show(GtkWidget* widget)
 {
- static void (*next_func)(GtkWidget* widget)=NULL;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping widget show\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_widget_show");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
+ void (*next_func)(GtkWidget* widget)=hk_next(HK_GTK_WIDGET_SHOW);
 
  next_func(widget);
 
@@ -163,19 +168,9 @@ void gtk_widget_show(GtkWidget* widget)
 
 void gtk_button_set_label(GtkButton* button, const char *label)
 {
- static void (*next_func)(GtkButton* button, const char *label)=NULL;
+ void (*next_func)(GtkButton* button, const char *label)=hk_next(HK_GTK_BUTTON_SET_LABEL);
  const char *ori=label;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping button label\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_button_set_label");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  /* ACEGLP */
  if (g_strcmp0(label, "Print")==0)
     /* Why KiCad people hates shortcuts? */
@@ -250,21 +245,14 @@ void load_print_options()
 */
 GtkPrintOperationResult gtk_print_operation_run(GtkPrintOperation* op, GtkPrintOperationAction action, GtkWindow* parent, GError** error)
 {
- static GtkPrintOperationResult (*next_func)(GtkPrintOperation* , GtkPrintOperationAction , GtkWindow* , GError** )=NULL;
+ GtkPrintOperationResult (*next_func)(GtkPrintOperation* , GtkPrintOperationAction , GtkWindow* , GError** )=hk_next(HK_GTK_PRINT_OPERATION_RUN);
  GtkPrintOperationResult res;
  GtkPrintSettings *print_sets;
  GtkSettings *gtk_sets;
+ static pthread_once_t options_once=PTHREAD_ONCE_INIT;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping print op run\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_print_operation_run");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-    load_print_options();
-   }
+ /* Only when printing, they are needed just here */
+ pthread_once(&options_once, load_print_options);
 
  print_sets = gtk_print_operation_get_print_settings(op);
  /* Select the file format and name */
@@ -290,17 +278,7 @@ GtkPrintOperationResult gtk_print_operation_run(GtkPrintOperation* op, GtkPrintO
 
 void gtk_label_set_text_with_mnemonic(GtkLabel *label, const gchar *str)
 {
- static void (*next_func)(GtkLabel *label, const gchar *str)=NULL;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping label set text\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_label_set_text_with_mnemonic");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
+ void (*next_func)(GtkLabel *label, const gchar *str)=hk_next(HK_GTK_LABEL_SET_TEXT_WITH_MNEMONIC);
 
  /* Create some accelerators to make the navigation easier */
   /* DRC Control dialog */
@@ -344,33 +322,21 @@ void gtk_label_set_text_with_mnemonic(GtkLabel *label, const gchar *str)
 }
 
 
+static char *chooser_fn;
+
 gchar *gtk_file_chooser_get_filename(GtkFileChooser *chooser)
 {
- static gchar *(*next_func)(GtkFileChooser *)=NULL;
- static char *fn;
+ gchar *(*next_func)(GtkFileChooser *)=hk_next(HK_GTK_FILE_CHOOSER_GET_FILENAME);
  gchar *res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping file chooser get filename\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_file_chooser_get_filename");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-    fn=getenv("KIAUTO_INTERPOSER_FILENAME");
-    if (fn==NULL)
-       printf("****** NOT DEFINED\n");
-   }
-
  res=next_func(chooser);
 
  pthread_mutex_lock(&lock);
- if (fn!=NULL)
+ if (chooser_fn!=NULL)
    {
-    printf("GTK:Filename:%s\n", fn);
+    printf("GTK:Filename:%s\n", chooser_fn);
     printf("GTK:Filename:**Changed from %s\n",res);
-    res=g_strdup(fn);
+    res=g_strdup(chooser_fn);
    }
  else
    {
@@ -384,19 +350,9 @@ gchar *gtk_file_chooser_get_filename(GtkFileChooser *chooser)
 
 FILE *fopen(const char *filename, const char *mode)
 {
- static FILE *(*next_func)(const char *, const char *)=NULL;
+ FILE *(*next_func)(const char *, const char *)=hk_next(HK_FOPEN);
  FILE *res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    /* printf("* wrapping fopen\n"); */
-    next_func=dlsym(RTLD_NEXT,"fopen");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  res=next_func(filename, mode);
 
  if (mode[0]=='w' && mode[1]=='t')
@@ -410,19 +366,9 @@ FILE *fopen(const char *filename, const char *mode)
 
 FILE *fopen64(const char *filename, const char *mode)
 {
- static FILE *(*next_func)(const char *, const char *)=NULL;
+ FILE *(*next_func)(const char *, const char *)=hk_next(HK_FOPEN64);
  FILE *res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    /* printf("* wrapping fopen\n"); */
-    next_func=dlsym(RTLD_NEXT,"fopen64");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  res=next_func(filename, mode);
 
  if (mode[0]=='w' && mode[1]=='t')
@@ -436,22 +382,12 @@ FILE *fopen64(const char *filename, const char *mode)
 
 int fclose(FILE *stream)
 {
- static int(*next_func)(FILE *)=NULL;
+ int(*next_func)(FILE *)=hk_next(HK_FCLOSE);
  int res;
  char path[1024];
  char result[1024];
  int fd;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    /* printf("* wrapping fclose\n"); */
-    next_func=dlsym(RTLD_NEXT,"fclose");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  fd=fileno(stream);
  /* Read out the link to our file descriptor. */
  sprintf(path, "/proc/self/fd/%d", fd);
@@ -470,19 +406,9 @@ int fclose(FILE *stream)
 
 int open64(const char *pathname, int flags, mode_t mode)
 {
- static int (*next_func)(const char *, int , mode_t)=NULL;
+ int (*next_func)(const char *, int , mode_t)=hk_next(HK_OPEN64);
  int res;
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    printf("* wrapping open\n");
-    next_func=dlsym(RTLD_NEXT,"open64");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  res=next_func(pathname, flags, mode);
 
  pthread_mutex_lock(&lock);
@@ -495,21 +421,11 @@ int open64(const char *pathname, int flags, mode_t mode)
 
 int close(int fd)
 {
- static int(*next_func)(int)=NULL;
+ int(*next_func)(int)=hk_next(HK_CLOSE);
  int res;
  char path[1024];
  char result[1024];
 
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    mutex_init();
-    /* printf("* wrapping fclose\n"); */
-    next_func=dlsym(RTLD_NEXT,"close");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
  /* Read out the link to our file descriptor. */
  sprintf(path, "/proc/self/fd/%d", fd);
  memset(result, 0, 1024);
@@ -524,3 +440,12 @@ int close(int fd)
  return res;
 }
 
+
+/* Resolves all the hooks and does the rest of the one time setup */
+__attribute__((constructor)) static void interposer_init(void)
+{
+ hk_init();
+ chooser_fn=getenv("KIAUTO_INTERPOSER_FILENAME");
+ if (chooser_fn==NULL)
+    printf("****** NOT DEFINED\n");
+}
@@ -140,27 +140,6 @@ void gtk_window_close(GtkWindow* window)
 }
 
 
-gint gtk_dialog_run(GtkDialog* dialog)
-{
- static gint (*next_func)(GtkDialog* dialog)=NULL;
- gint res;
-
- if (next_func==NULL)
-   { /* Initialization */
-    char *msg;
-    printf("* wrapping dialog run\n");
-    next_func=dlsym(RTLD_NEXT,"gtk_dialog_run");
-    if ((msg=dlerror())!=NULL)
-       printf("** dlopen failed : %s\n", msg);
-   }
-
- res = next_func(dialog);
- printf("GTK:Dialog Run:%s\n", gtk_window_get_title(GTK_WINDOW(dialog)));
- fflush(stdout);
- return res;
-}
-
-
 GtkWidget *gtk_scrolled_window_new(GtkAdjustment *hadjustment, GtkAdjustment *vadjustment)
 {
  static GtkWidget *(*next_func)(GtkAdjustment *, GtkAdjustment *)=NULL;
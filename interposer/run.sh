@@ -4,4 +4,7 @@
 #LANG=C LD_PRELOAD=`pwd`/libinterposer.so eeschema "$@" | grep "GTK:"
 #LANG=C LD_PRELOAD=`pwd`/libinterposer.so eeschema "$@"
 #LANG=C LD_PRELOAD=`pwd`/libinterposer.so pcbnew "$@" | grep "IO:Wait"
+# Rules to add accelerators
+export KIAUTO_INTERPOSER_REMAP=`pwd`/../kiauto/interposer/remap.txt
+export KIAUTO_INTERPOSER_KICAD=6
 LANG=C LD_PRELOAD=`pwd`/libinterposer.so pcbnew "$@"
@@ -0,0 +1,337 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Asyncio version of the interposer dialog, so one process can drive many KiCad sessions.
+Each session has its own cfg (see session_cfg), the KiCad environment (interposer and X display) is passed to the
+process, os.environ isn't modified. The interposer events are read by the event loop, no threads.
+The coroutines mirror the ones in kiauto/interposer.py and share the events processing (process_event). But errors
+are reported using KiCadError, we can't exit the supervisor because one session failed.
+
+Example:
+    cfg = session_cfg(logger, ':1')
+    await start_kicad(cfg, ['pcbnew', 'board.kicad_pcb'])
+    await wait_queue(cfg, 'GTK:Main:In')
+    await open_dialog_i(cfg, 'Design Rules Checker', 'ctrl+shift+i')
+"""
+import argparse
+import asyncio
+from asyncio.subprocess import PIPE, DEVNULL
+import os
+import re
+import signal
+import time
+import psutil
+from kiauto.interposer import (INTERPOSER_PREFIXES, KICAD_EXIT_MSG, INFO_DIALOGS, DIALOG_AUTO_MSG, SWAP_MSG, MAIN_IDLE,
+                               InterposerDialog, interposer_lib_path, interposer_env, load_auto_dialogs,
+                               get_wait_matcher, process_event, unexpected_window, collect_io_from_queue,
+                               log_recent_dialog)
+
+# The interposer lines can be long (i.e. dialog texts)
+LINE_LIMIT = 1 << 20
+WINDOW_POLL = 0.5
+
+
+class KiCadError(RuntimeError):
+    """ Something went wrong with one session, the others can continue """
+    pass
+
+
+def session_cfg(logger, display, profile='pcb', kicad=6, env=None, time_out_scale=1.0, verbose=0, dialog_log=None):
+    """ A cfg for one KiCad session. The environment for KiCad and the tools is cfg.env.
+        `env` adds or replaces variables (i.e. KIAUTO_INTERPOSER_FILENAME) """
+    interposer_lib = interposer_lib_path(profile)
+    if interposer_lib is None:
+        raise KiCadError('The asyncio API needs the interposer')
+    cfg = argparse.Namespace()
+    # The stdout is the only channel we support, the rest are for the session that started us
+    cfg.env = {k: v for k, v in os.environ.items() if not k.startswith('KIAUTO_INTERPOSER_')}
+    cfg.env.update(interposer_env(interposer_lib, kicad))
+    cfg.env['DISPLAY'] = display
+    if env:
+        cfg.env.update(env)
+    cfg.auto_dialogs, cfg.auto_dialogs_prefixes = load_auto_dialogs(cfg.env['KIAUTO_INTERPOSER_DIALOGS'], kicad)
+    cfg.use_interposer = cfg.enable_interposer = interposer_lib
+    cfg.logger = logger
+    cfg.verbose = verbose
+    cfg.time_out_scale = time_out_scale
+    cfg.ki5 = kicad == 5
+    cfg.window_title_end = ' Editor'
+    cfg.interposer_dialog = InterposerDialog(dialog_log)
+    cfg.popen_obj = cfg.kicad_process = cfg.kicad_q = None
+    cfg.collecting_io = False
+    cfg.last_msg_time = 0
+    cfg.idle_events = cfg.kicad_idle = False
+    cfg.frames = []
+    cfg.render_settled = False
+    cfg.settled_frame = cfg.captured_frame = -1
+    return cfg
+
+
+async def read_events(stream, queue):
+    """ Moves the interposer lines to the queue, None when KiCad closes its stdout """
+    tm_start = time.time()
+    while True:
+        line = await stream.readline()
+        if not line:
+            break
+        # Avoid problems when KiCad 5 sends an invalid Unicode sequence
+        line = line.decode(errors='ignore')
+        if line.startswith(INTERPOSER_PREFIXES):
+            queue.put_nowait((time.time()-tm_start, line))
+    queue.put_nowait(None)
+
+
+async def start_kicad(cfg, cmd, stderr=DEVNULL):
+    """ Starts KiCad and the task reading the interposer events """
+    cfg.popen_obj = await asyncio.create_subprocess_exec(*cmd, stdout=PIPE, stderr=stderr, env=cfg.env,
+                                                         start_new_session=True, limit=LINE_LIMIT)
+    cfg.kicad_process = psutil.Process(cfg.popen_obj.pid)
+    cfg.kicad_q = asyncio.Queue()
+    cfg.reader = asyncio.ensure_future(read_events(cfg.popen_obj.stdout, cfg.kicad_q))
+    cfg.logger.debug('KiCad PID: {} (DISPLAY={})'.format(cfg.popen_obj.pid, cfg.env['DISPLAY']))
+    return cfg.popen_obj
+
+
+async def kicad_died(cfg, kicad_can_exit):
+    """ KiCad closed the stdout """
+    # Keep the mark for the next waits
+    cfg.kicad_q.put_nowait(None)
+    if kicad_can_exit:
+        return KICAD_EXIT_MSG
+    log_recent_dialog(cfg)
+    try:
+        error_level = await asyncio.wait_for(cfg.popen_obj.wait(), 3)
+    except asyncio.TimeoutError:
+        error_level = None
+    raise KiCadError('KiCad unexpectedly died (error level {})'.format(error_level))
+
+
+async def wait_queue(cfg, strs='', starts=False, times=1, timeout=300, do_to=True, kicad_can_exit=False, with_windows=False,
+                     prefixes=()):
+    """ Wait for a string in the queue, prefixes match the beginning of the line even when starts is False """
+    if isinstance(strs, str):
+        strs = [strs]
+    matcher = get_wait_matcher(tuple(strs), starts, tuple(prefixes))
+    loop = asyncio.get_running_loop()
+    end_time = loop.time()+timeout*cfg.time_out_scale
+    msg = 'Waiting for `{}` starts={} times={}'.format(strs, starts, times)
+    cfg.interposer_dialog.append('KiAuto:'+msg)
+    if cfg.verbose > 1:
+        cfg.logger.debug(msg)
+    while True:
+        if cfg.kicad_q.empty():
+            remaining = end_time-loop.time()
+            if remaining <= 0:
+                break
+            try:
+                item = await asyncio.wait_for(cfg.kicad_q.get(), remaining)
+            except asyncio.TimeoutError:
+                break
+        else:
+            # Most of the time the events are already there
+            item = cfg.kicad_q.get_nowait()
+        if item is None:
+            return await kicad_died(cfg, kicad_can_exit)
+        tm, line = item
+        line = process_event(cfg, tm, line[:-1])
+        if line == '':
+            continue
+        if matcher.any:
+            # Waiting for anything ... but not for nothing
+            return line
+        if matcher.match(line):
+            times -= 1
+            if times == 0:
+                cfg.interposer_dialog.append('KiAuto:match')
+                cfg.logger.debug('Interposer match: '+line)
+                return line
+            cfg.interposer_dialog.append('KiAuto:times '+str(times))
+            cfg.logger.debug('Interposer match, times='+str(times))
+        title = unexpected_window(cfg, line, with_windows, kicad_can_exit)
+        if title is not None:
+            if title in INFO_DIALOGS:
+                await dismiss_dialog(cfg, title, 'Return')
+            else:
+                raise KiCadError('Unknown KiCad dialog: '+title)
+    if do_to:
+        raise KiCadError('Timed out waiting for `{}`'.format(strs))
+    return None
+
+
+async def wait_swap(cfg, times=1, kicad_can_exit=False):
+    """ Wait an OpenGL draw (buffer swap) """
+    if not times:
+        return None
+    return await wait_queue(cfg, SWAP_MSG, starts=True, times=times, kicad_can_exit=kicad_can_exit)
+
+
+async def wait_kicad_ready_i(cfg, swaps=0, kicad_can_exit=False):
+    """ Wait until KiCad is waiting for events """
+    res = await wait_swap(cfg, swaps, kicad_can_exit=kicad_can_exit)
+    if cfg.idle_events:
+        # Pending messages can change the state, so we process all of them
+        while not cfg.kicad_idle or not cfg.kicad_q.empty():
+            new_res = await wait_queue(cfg, [SWAP_MSG, MAIN_IDLE], starts=True, timeout=1, do_to=False,
+                                       kicad_can_exit=kicad_can_exit)
+            if new_res == KICAD_EXIT_MSG:
+                return new_res
+            if new_res is not None and new_res.startswith(SWAP_MSG):
+                res = new_res
+        return res
+    # Before entering the main loop, poll the process status
+    try:
+        while cfg.kicad_process.status() != psutil.STATUS_SLEEPING:
+            new_res = await wait_queue(cfg, SWAP_MSG, starts=True, timeout=0.1, do_to=False,
+                                       kicad_can_exit=kicad_can_exit)
+            if new_res == KICAD_EXIT_MSG:
+                return new_res
+            if new_res is not None:
+                res = new_res
+    except psutil.NoSuchProcess:
+        return KICAD_EXIT_MSG
+    return res
+
+
+async def xdotool(cfg, command):
+    """ Runs xdotool using the session display """
+    cfg.logger.debug(['xdotool'] + command)
+    proc = await asyncio.create_subprocess_exec('xdotool', *command, stdout=PIPE, stderr=DEVNULL, env=cfg.env)
+    out, _ = await proc.communicate()
+    if proc.returncode:
+        raise KiCadError('xdotool {} failed ({})'.format(command, proc.returncode))
+    return out.decode()
+
+
+async def wait_for_window(cfg, name, timeout=10):
+    """ Wait for a visible window with this name (a regex) and focus it, returns its id """
+    loop = asyncio.get_running_loop()
+    end_time = loop.time()+timeout*cfg.time_out_scale
+    regex = '^'+re.escape(name)+'$'
+    while True:
+        try:
+            ids = (await xdotool(cfg, ['search', '--onlyvisible', '--name', regex])).split()
+        except KiCadError:
+            # xdotool fails when nothing matches
+            ids = []
+        if ids:
+            id = ids[0] if len(ids) == 1 else ids[1]
+            await xdotool(cfg, ['windowfocus', '--sync', id])
+            return id
+        if loop.time() > end_time:
+            raise KiCadError('Timed out waiting for the `{}` window'.format(name))
+        await asyncio.sleep(WINDOW_POLL)
+
+
+async def dismiss_dialog(cfg, title, keys):
+    cfg.logger.debug('Dismissing dialog `{}` using {}'.format(title, keys))
+    await wait_for_window(cfg, title, 1)
+    if isinstance(keys, str):
+        keys = [keys]
+    await xdotool(cfg, ['key']+keys)
+
+
+async def open_dialog_i(cfg, name, keys, no_show=False, no_wait=False, no_main=False, extra_msg=None):
+    """ Sends the keys to open a dialog and waits for it. Returns its name and window id """
+    # Wait for KiCad to be sleeping
+    await wait_kicad_ready_i(cfg)
+    cfg.logger.info('Opening dialog `{}` {}'.format(name, '('+extra_msg+')' if extra_msg is not None else ''))
+    if isinstance(keys, str):
+        keys = ['key', keys]
+    await xdotool(cfg, keys)
+    pre_gtk_title = 'GTK:Window Title:'
+    pre_gtk = pre_gtk_title if no_show else 'GTK:Window Show:'
+    if isinstance(name, str):
+        name = [name]
+    name_w_pre = [pre_gtk+f for f in name]
+    # Add the async dialogs
+    name_w_pre.extend(pre_gtk_title+t for t in INFO_DIALOGS)
+    # Answered by the interposer, but it could get our keys
+    auto_pres = [DIALOG_AUTO_MSG+t+'|' for t in INFO_DIALOGS]
+    while True:
+        res = await wait_queue(cfg, name_w_pre, with_windows=True, prefixes=auto_pres)
+        if res.startswith(DIALOG_AUTO_MSG):
+            # Wait until the dialog is gone and send the keys again
+            await wait_kicad_ready_i(cfg)
+            await xdotool(cfg, keys)
+            continue
+        title = res[len(pre_gtk_title):]
+        if title not in INFO_DIALOGS:
+            break
+        await dismiss_dialog(cfg, title, 'Return')
+        await xdotool(cfg, keys)
+    name = res[len(pre_gtk):]
+    if no_wait:
+        return name, None
+    if not no_main:
+        await wait_queue(cfg, 'GTK:Main:In')
+    await wait_kicad_ready_i(cfg)
+    # The dialog is there, just make sure it has the focus
+    return name, await wait_for_window(cfg, name, 1)
+
+
+async def send_keys(cfg, msg, keys, closes=None, delay_io=False):
+    cfg.logger.info(msg)
+    if isinstance(keys, str):
+        keys = ['key', keys]
+    if delay_io:
+        collect_io_from_queue(cfg)
+    await xdotool(cfg, keys)
+    if closes is not None:
+        if isinstance(closes, str):
+            closes = [closes]
+        for w in closes:
+            await wait_queue(cfg, 'GTK:Window Destroy:'+w)
+        await wait_kicad_ready_i(cfg)
+
+
+async def wait_create_i(cfg, name, fn):
+    """ Wait for the interposer to report the file as complete (closed or renamed into place).
+        Returns its size """
+    cfg.logger.info('Wait for '+name+' file creation')
+    open_msg = 'IO:open:'+fn
+    # The close and complete use the name from the kernel, symlinks resolved
+    real_fn = os.path.realpath(fn)
+    close_msg = 'IO:close:'+real_fn
+    complete_msg = 'IO:Complete:'+real_fn+' '
+    msg = None
+    if cfg.collecting_io:
+        cfg.collecting_io = False
+        for line in cfg.collected_io:
+            if line.startswith(complete_msg):
+                msg = line
+    while msg is None:
+        res = await wait_queue(cfg, [open_msg, close_msg, complete_msg], starts=True)
+        if res.startswith(complete_msg):
+            msg = res
+        else:
+            cfg.logger.debug('Found IO '+res)
+    size = int(msg[len(complete_msg):])
+    cfg.logger.debug('{} file complete ({} bytes)'.format(name, size))
+    if size == 0:
+        raise KiCadError('KiCad created an empty {} file (`{}`)'.format(name, fn))
+    if size < 0:
+        cfg.logger.warning('The {} file (`{}`) is no longer there'.format(name, fn))
+    await wait_kicad_ready_i(cfg)
+    return size
+
+
+async def exit_kicad_i(cfg, timeout=10):
+    """ Exits KiCad, killing it if it doesn't exit. Returns the error level """
+    if await wait_kicad_ready_i(cfg, kicad_can_exit=True) != KICAD_EXIT_MSG:
+        try:
+            # The interposer discards the changes
+            await send_keys(cfg, 'Exiting KiCad', 'ctrl+q')
+            await wait_queue(cfg, KICAD_EXIT_MSG, timeout=timeout, kicad_can_exit=True, with_windows=True)
+        except KiCadError as e:
+            cfg.logger.warning('{}, killing KiCad'.format(e))
+            # KiCad nightly uses a shell script, kill the whole group
+            try:
+                os.killpg(os.getpgid(cfg.popen_obj.pid), signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+    error_level = await cfg.popen_obj.wait()
+    await cfg.reader
+    return error_level
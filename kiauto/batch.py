@@ -0,0 +1,205 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Parallel batch runner.
+Runs the jobs listed in a manifest using N workers. Each worker has its own KiCad config dir, and each job runs its own
+Xvfb and interposer channel, so the jobs don't interfere.
+The jobs are distributed to the workers grouped by input file, an idle worker steals the queued jobs for one file from
+the most loaded one. Never the file the victim is using, two KiCads using the same file collide (project and lock
+files).
+"""
+from collections import deque
+import json
+import os
+import shutil
+from subprocess import run, STDOUT
+from threading import Thread, Lock
+import time
+
+TOOLS = ('pcbnew_do', 'eeschema_do', 'kicad2step_do')
+# Files that we don't want to copy to the workers config
+CONFIG_IGNORE = ('*.pre_script', '*.lock')
+
+
+class BatchError(Exception):
+    pass
+
+
+class Job(object):
+    def __init__(self, num, data, base_dir):
+        """ Jobs are JSON objects: {"tool": "pcbnew_do", "action": "run_drc", "file": "board.kicad_pcb",
+            "output_dir": "out", "options": ["--ignore_unconnected"], "args": ["-v"]} """
+        if not isinstance(data, dict):
+            raise BatchError('job {}: must be an object'.format(num+1))
+        # Index in the manifest, the user sees them starting from 1
+        self.num = num
+        self.id = num+1
+        self.tool = data.get('tool', 'pcbnew_do')
+        if self.tool not in TOOLS:
+            raise BatchError('job {}: unknown tool `{}`'.format(num+1, self.tool))
+        self.action = data.get('action')
+        if self.action is None and self.tool != 'kicad2step_do':
+            raise BatchError('job {}: missing action'.format(num+1))
+        self.file = data.get('file')
+        if not self.file:
+            raise BatchError('job {}: missing file'.format(num+1))
+        self.file = os.path.join(base_dir, self.file)
+        self.output_dir = os.path.join(base_dir, data.get('output_dir', '.'))
+        self.options = [str(o) for o in data.get('options', [])]
+        self.args = [str(o) for o in data.get('args', [])]
+        self.name = data.get('name', '{}:{}:{}'.format(self.tool, self.action, os.path.basename(self.file)))
+        # Moved to another worker
+        self.stolen = False
+
+    def command(self, tools_dir):
+        tool = os.path.join(tools_dir, self.tool)
+        cmd = [tool if os.path.isfile(tool) else self.tool]+self.args
+        if self.tool == 'kicad2step_do':
+            return cmd+self.options+['--output-dir', self.output_dir, self.file]
+        return cmd+[self.action]+self.options+[self.file, self.output_dir]
+
+
+def load_manifest(fname):
+    """ JSON lines, one job for each line. Empty lines and lines starting with # are skipped """
+    base_dir = os.path.dirname(os.path.abspath(fname))
+    jobs = []
+    with open(fname, 'rt') as f:
+        for n, ln in enumerate(f):
+            ln = ln.strip()
+            if not ln or ln[0] == '#':
+                continue
+            try:
+                data = json.loads(ln)
+            except ValueError as e:
+                raise BatchError('line {}: {}'.format(n+1, e))
+            jobs.append(Job(len(jobs), data, base_dir))
+    return jobs
+
+
+class Worker(Thread):
+    def __init__(self, pool, id):
+        super().__init__(name='kiauto_worker_{}'.format(id), daemon=True)
+        self.pool = pool
+        self.id = id
+        self.queue = deque()
+        # Input file of the running job
+        self.running = None
+        self.home = os.path.join(pool.work_dir, 'worker_{}'.format(id))
+        self.env = dict(os.environ)
+        # Our own KiCad configuration, the tools modify it
+        self.env['KICAD_CONFIG_HOME'] = self.home
+
+    def setup_config(self, conf_path, ki5):
+        # KiCad 6 adds the version to KICAD_CONFIG_HOME
+        dest = self.home if ki5 else os.path.join(self.home, os.path.basename(conf_path))
+        if os.path.isdir(dest):
+            shutil.rmtree(dest)
+        if conf_path and os.path.isdir(conf_path):
+            shutil.copytree(conf_path, dest, ignore=shutil.ignore_patterns(*CONFIG_IGNORE))
+        else:
+            os.makedirs(dest)
+
+    def run(self):
+        while True:
+            job = self.pool.next_job(self)
+            if job is None:
+                break
+            self.pool.run_job(self, job, job.stolen)
+
+
+class WorkerPool(object):
+    def __init__(self, logger, jobs, workers, work_dir, tools_dir, stop_on_error=False):
+        self.logger = logger
+        self.jobs = jobs
+        self.work_dir = work_dir
+        self.tools_dir = tools_dir
+        self.stop_on_error = stop_on_error
+        self.stopped = False
+        self.lock = Lock()
+        self.results = [None]*len(jobs)
+        self.workers = [Worker(self, i) for i in range(max(1, min(workers, len(jobs))))]
+        self.assign()
+
+    def assign(self):
+        """ Jobs using the same file go to the same worker, the biggest groups first """
+        groups = {}
+        for job in self.jobs:
+            groups.setdefault(job.file, []).append(job)
+        for group in sorted(groups.values(), key=len, reverse=True):
+            min(self.workers, key=lambda w: len(w.queue)).queue.extend(group)
+
+    def steal(self, worker):
+        """ Moves the jobs for one file from the most loaded worker to our queue.
+            The jobs for a file are always in one worker, so nobody else is using it. """
+        for victim in sorted(self.workers, key=lambda w: len(w.queue), reverse=True):
+            # Take it from the end, the owner works from the start
+            fname = next((j.file for j in reversed(victim.queue) if j.file != victim.running), None)
+            if fname is None:
+                continue
+            for job in victim.queue:
+                if job.file == fname:
+                    job.stolen = True
+                    worker.queue.append(job)
+            victim.queue = deque(j for j in victim.queue if j.file != fname)
+            return
+
+    def next_job(self, worker):
+        """ Our next job, or one from the most loaded worker """
+        with self.lock:
+            worker.running = None
+            if self.stopped:
+                return None
+            if not worker.queue:
+                self.steal(worker)
+                if not worker.queue:
+                    return None
+            job = worker.queue.popleft()
+            worker.running = job.file
+            return job
+
+    def run_job(self, worker, job, stolen):
+        cmd = job.command(self.tools_dir)
+        self.logger.info('Worker {}: starting job {} `{}`{}'.format(worker.id, job.id, job.name,
+                                                                    ' (stolen)' if stolen else ''))
+        self.logger.debug('Worker {}: {}'.format(worker.id, cmd))
+        log_file = os.path.join(self.work_dir, 'job_{:04d}.log'.format(job.id))
+        start = time.monotonic()
+        try:
+            os.makedirs(job.output_dir, exist_ok=True)
+            with open(log_file, 'wt') as f:
+                ret = run(cmd, stdout=f, stderr=STDOUT, env=worker.env, cwd=self.work_dir).returncode
+        except OSError as e:
+            self.logger.error('Worker {}: job {} failed to start: {}'.format(worker.id, job.id, e))
+            ret = -1
+        elapsed = time.monotonic()-start
+        res = {'job': job.id, 'name': job.name, 'status': ret, 'worker': worker.id, 'stolen': stolen,
+               'time': round(elapsed, 3), 'log': log_file}
+        if ret:
+            self.logger.error('Worker {}: job {} `{}` returned {} (see {})'.format(worker.id, job.id, job.name, ret, log_file))
+        else:
+            self.logger.info('Worker {}: job {} `{}` done in {:.1f} s'.format(worker.id, job.id, job.name, elapsed))
+        with self.lock:
+            self.results[job.num] = res
+            if ret and self.stop_on_error:
+                self.stopped = True
+
+    def run(self, conf_path, ki5):
+        self.logger.info('Running {} jobs using {} workers'.format(len(self.jobs), len(self.workers)))
+        start = time.monotonic()
+        for w in self.workers:
+            w.setup_config(conf_path, ki5)
+            w.start()
+        for w in self.workers:
+            w.join()
+        for job in self.jobs:
+            if self.results[job.num] is None:
+                self.results[job.num] = {'job': job.id, 'name': job.name, 'status': None, 'worker': None, 'stolen': False,
+                                         'time': 0, 'log': None}
+        ok = sum(1 for r in self.results if r['status'] == 0)
+        stolen = sum(1 for r in self.results if r['stolen'])
+        self.logger.info('{} of {} jobs succeeded in {:.1f} s ({} stolen)'.format(ok, len(self.jobs), time.monotonic()-start,
+                         stolen))
+        return self.results
@@ -0,0 +1,320 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Pool of virtual X servers.
+Starting Xvfb and the window manager for each job takes seconds (see recorded_xvfb). The pool (kiauto_display_pool)
+keeps N Xvfb (+WM) running and leases them to the jobs using a UNIX socket, enabled using KIAUTO_DISPLAY_POOL.
+Protocol, a JSON object for each line:
+client: {"width": W, "height": H, "depth": D, "wm": true|false}
+server: {"display": ":N", "wm": true|false} or {"error": "text"}
+The lease lasts while the client keeps the connection open, so a job that crashes releases its display. Then the
+display is reset (stuck keys released and windows left by the job killed), or restarted if the reset fails.
+Xvfb chooses a free display number (-displayfd), so the pool and other jobs don't collide.
+"""
+import json
+import os
+import shutil
+import socket
+from subprocess import Popen, run, DEVNULL, TimeoutExpired, SubprocessError
+from tempfile import gettempdir
+from threading import Thread, Condition
+import time
+
+# Keys that a killed job could leave pressed
+MODIFIERS = ['Control_L', 'Control_R', 'Shift_L', 'Shift_R', 'Alt_L', 'Alt_R', 'Super_L', 'Super_R']
+START_TIMEOUT = 10
+CMD_TIMEOUT = 5
+# Time a job waits for a display, then it starts its own X server
+LEASE_TIMEOUT = 120
+
+
+def default_socket():
+    run_dir = os.environ.get('XDG_RUNTIME_DIR')
+    if run_dir:
+        return os.path.join(run_dir, 'kiauto_display_pool.sock')
+    return os.path.join(gettempdir(), 'kiauto_display_pool_{}.sock'.format(os.getuid()))
+
+
+class DisplayPoolError(Exception):
+    pass
+
+
+class Display(object):
+    def __init__(self, width, height, depth, use_wm, logger):
+        self.width = width
+        self.height = height
+        self.depth = depth
+        self.use_wm = use_wm
+        self.logger = logger
+        self.name = None
+        self.xvfb = self.wm = None
+        self.leases = 0
+
+    def env(self):
+        env = dict(os.environ)
+        env['DISPLAY'] = self.name
+        return env
+
+    def run(self, cmd):
+        """ Runs a command using this display, returns its output or None if it failed """
+        try:
+            res = run(cmd, env=self.env(), capture_output=True, timeout=CMD_TIMEOUT)
+        except (OSError, SubprocessError):
+            return None
+        return None if res.returncode else res.stdout.decode()
+
+    def wait_for(self, cmd):
+        end_time = time.time()+START_TIMEOUT
+        while time.time() < end_time:
+            if self.run(cmd) is not None:
+                return True
+            time.sleep(0.1)
+        return False
+
+    def start(self):
+        rd, wr = os.pipe()
+        try:
+            self.xvfb = Popen(['Xvfb', '-displayfd', str(wr), '-screen', '0', '{}x{}x{}'.format(self.width, self.height,
+                              self.depth), '-nolisten', 'tcp'], pass_fds=(wr,), stdout=DEVNULL, stderr=DEVNULL,
+                              start_new_session=True)
+        finally:
+            os.close(wr)
+        # Xvfb writes the display number when it's ready to accept connections
+        with os.fdopen(rd) as f:
+            num = f.readline().strip()
+        if not num.isdigit():
+            self.stop()
+            raise DisplayPoolError('Xvfb failed to start')
+        self.name = ':'+num
+        if self.use_wm:
+            self.wm = Popen(['fluxbox'], env=self.env(), stdout=DEVNULL, stderr=DEVNULL, start_new_session=True)
+            if shutil.which('wmctrl') and not self.wait_for(['wmctrl', '-m']):
+                self.stop()
+                raise DisplayPoolError('Timed out waiting for the WM on '+self.name)
+        self.leases = 0
+        self.logger.debug('Display {} ready'.format(self.name))
+
+    def stop(self):
+        for proc in (self.wm, self.xvfb):
+            if proc is not None and proc.poll() is None:
+                proc.kill()
+                try:
+                    proc.wait(CMD_TIMEOUT)
+                except TimeoutExpired:
+                    pass
+        self.wm = self.xvfb = None
+
+    def alive(self):
+        if self.xvfb is None or self.xvfb.poll() is not None or (self.wm is not None and self.wm.poll() is not None):
+            return False
+        if shutil.which('xdpyinfo'):
+            return self.run(['xdpyinfo']) is not None
+        return True
+
+    def reset(self):
+        """ Leaves the display as a new one, returns False if we must restart it """
+        if not self.alive():
+            return False
+        if shutil.which('xdotool'):
+            self.run(['xdotool', 'keyup']+MODIFIERS)
+        # Windows left by the job
+        if self.use_wm and shutil.which('wmctrl'):
+            out = self.run(['wmctrl', '-l'])
+            ids = [ln.split()[0] for ln in out.splitlines() if ln.strip()] if out else []
+        elif shutil.which('xdotool'):
+            out = self.run(['xdotool', 'search', '--onlyvisible', '--name', '.'])
+            ids = out.split() if out else []
+        else:
+            ids = []
+        if ids:
+            self.logger.debug('Display {}: killing {} windows left by the job'.format(self.name, len(ids)))
+            for id in ids:
+                self.run(['xdotool', 'windowkill', id])
+        return self.alive()
+
+
+class DisplayPool(object):
+    def __init__(self, logger, size, width, height, depth, use_wm, socket_path, max_leases=0):
+        self.logger = logger
+        self.size = size
+        self.width = width
+        self.height = height
+        self.depth = depth
+        self.use_wm = use_wm
+        self.socket_path = socket_path
+        # Restart the displays after this number of leases, 0 is never
+        self.max_leases = max_leases
+        self.displays = []
+        self.free = []
+        self.cond = Condition()
+        self.sock = None
+
+    def new_display(self):
+        d = Display(self.width, self.height, self.depth, self.use_wm, self.logger)
+        d.start()
+        return d
+
+    def start(self):
+        """ Starts the displays in parallel """
+        errors = []
+
+        def start_one():
+            try:
+                d = self.new_display()
+            except (OSError, DisplayPoolError) as e:
+                errors.append(str(e))
+                return
+            with self.cond:
+                self.displays.append(d)
+                self.free.append(d)
+        threads = [Thread(target=start_one) for _ in range(self.size)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        if errors:
+            self.close()
+            raise DisplayPoolError(errors[0])
+        self.logger.info('{} displays ready: {}'.format(len(self.displays), ' '.join(d.name for d in self.displays)))
+
+    def lease(self):
+        with self.cond:
+            while not self.free:
+                if not self.displays:
+                    # All failed to restart, nothing will be released
+                    raise DisplayPoolError('no displays left, all failed to restart')
+                self.cond.wait()
+            d = self.free.pop(0)
+        d.leases += 1
+        return d
+
+    def release(self, d):
+        """ Reset the display, or restart it, and make it available """
+        if (self.max_leases and d.leases >= self.max_leases) or not d.reset():
+            self.logger.debug('Restarting display '+d.name)
+            d.stop()
+            try:
+                d.start()
+            except (OSError, DisplayPoolError) as e:
+                self.logger.error('Unable to restart a display: {}'.format(e))
+                with self.cond:
+                    self.displays.remove(d)
+                    # The waiting jobs must know if this was the last one
+                    self.cond.notify_all()
+                return
+        with self.cond:
+            self.free.append(d)
+            self.cond.notify()
+
+    def handle(self, conn):
+        with conn:
+            f = conn.makefile('rw')
+            try:
+                req = json.loads(f.readline())
+            except ValueError:
+                return
+            if ((req.get('width'), req.get('height'), req.get('depth')) != (self.width, self.height, self.depth) or
+               (bool(req.get('wm')) != self.use_wm and self.use_wm)):
+                # Without a WM the job can start its own
+                f.write(json.dumps({'error': 'the pool uses {}x{}x{} {} a WM'.format(self.width, self.height, self.depth,
+                                    'with' if self.use_wm else 'without')})+'\n')
+                f.flush()
+                return
+            try:
+                d = self.lease()
+            except DisplayPoolError as e:
+                f.write(json.dumps({'error': str(e)})+'\n')
+                f.flush()
+                return
+            self.logger.debug('Display {} leased'.format(d.name))
+            try:
+                f.write(json.dumps({'display': d.name, 'wm': self.use_wm})+'\n')
+                f.flush()
+                # The lease ends when the client closes the connection
+                while conn.recv(1024):
+                    pass
+            except OSError:
+                pass
+            finally:
+                self.logger.debug('Display {} released'.format(d.name))
+                self.release(d)
+
+    def serve_forever(self):
+        if os.path.exists(self.socket_path):
+            # Stale socket from a previous run?
+            with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as test:
+                try:
+                    test.connect(self.socket_path)
+                    in_use = True
+                except OSError:
+                    in_use = False
+            if in_use:
+                raise DisplayPoolError('Another pool is using '+self.socket_path)
+            os.remove(self.socket_path)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(self.socket_path)
+        os.chmod(self.socket_path, 0o600)
+        self.sock.listen(64)
+        self.logger.info('Serving displays at '+self.socket_path)
+        while True:
+            conn, _ = self.sock.accept()
+            Thread(target=self.handle, args=(conn,), daemon=True).start()
+
+    def close(self):
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+            if os.path.exists(self.socket_path):
+                os.remove(self.socket_path)
+        for d in self.displays:
+            d.stop()
+
+
+class DisplayLease(object):
+    """ A display leased from the pool, used like xvfbwrapper.Xvfb: DISPLAY is changed while we have it """
+    def __init__(self, socket_path, width, height, depth, use_wm, logger):
+        self.logger = logger
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        # A stuck pool must not stop the job, it can start its own X server
+        self.sock.settimeout(LEASE_TIMEOUT)
+        try:
+            self.sock.connect(socket_path)
+            f = self.sock.makefile('rw')
+            f.write(json.dumps({'width': width, 'height': height, 'depth': depth, 'wm': use_wm})+'\n')
+            f.flush()
+            # Blocks until a display is available
+            res = f.readline()
+        except socket.timeout:
+            self.sock.close()
+            raise DisplayPoolError('no display available after {} s'.format(LEASE_TIMEOUT))
+        except OSError as e:
+            self.sock.close()
+            raise DisplayPoolError(str(e))
+        try:
+            res = json.loads(res)
+        except ValueError:
+            res = {'error': 'the pool closed the connection'}
+        if 'error' in res:
+            self.sock.close()
+            raise DisplayPoolError(res['error'])
+        self.display = res['display']
+        # When False the job must start its own WM
+        self.wm = res['wm']
+        self.old_display = None
+
+    def __enter__(self):
+        self.old_display = os.environ.get('DISPLAY')
+        os.environ['DISPLAY'] = self.display
+        self.logger.debug('Using display {} from the pool'.format(self.display))
+        return self
+
+    def __exit__(self, type, value, traceback):
+        if self.old_display is None:
+            os.environ.pop('DISPLAY', None)
+        else:
+            os.environ['DISPLAY'] = self.old_display
+        # Release it
+        self.sock.close()
@@ -12,20 +12,29 @@ Utilities related to the filesystem and file names.
 
 Note: Only wait_for_file_created_by_process is from the original project.
 """
+import gzip
 import os
 import time
 import re
 import shutil
 import atexit
+import hashlib
 from subprocess import DEVNULL
+from tempfile import gettempdir, mkdtemp
 # python3-psutil
 import psutil
 import json
 
-from kiauto.misc import (WRONG_ARGUMENTS, KICAD_VERSION_5_99, Config, READ_ONLY_PROBLEM)
+from kiauto.misc import (WRONG_ARGUMENTS, KICAD_VERSION_5_99, Config, READ_ONLY_PROBLEM, __version__)
 from kiauto import log
 logger = log.get_logger(__name__)
 time_out_scale = 1.0
+# Files not copied to the private configs
+CONFIG_IGNORE = ('.pre_script', '.lock')
+# Remove templates replaced an hour ago, jobs could still be copying them
+OLD_TEMPLATE = 3600
+# Pid and start time of the job using a private config
+JOB_OWNER = 'owner'
 
 
 def set_time_out_scale(scale):
@@ -161,7 +170,7 @@ def remove_lib_table(fname):
         os.remove(fname)
 
 
-def check_lib_table(fuser, fsys):
+def check_lib_table(fuser, fsys, remove_at_exit=True):
     if not os.path.isfile(fuser):
         logger.debug('Missing default sym-lib-table')
         for f in fsys:
@@ -172,7 +181,8 @@ def check_lib_table(fuser, fsys):
                        ' creating an empty one')  # pragma: no cover
         with open(fuser, 'wt') as f:
             f.write('({} )\n'.format(os.path.basename(fuser).replace('-', '_')))
-        atexit.register(remove_lib_table, fuser)
+        if remove_at_exit:
+            atexit.register(remove_lib_table, fuser)
 
 
 def restore_one_config(name, fname, fbkp):
@@ -195,15 +205,20 @@ def restore_config(cfg):
     cfg.conf_3dview_bkp = restore_one_config('3D viewer', cfg.conf_3dview, cfg.conf_3dview_bkp)
 
 
-def backup_config(name, file, err, cfg):
-    config_file = file
+def check_config_backup(name, file, err):
+    """ If we have an old back-up ask for the user to solve it """
     old_config_file = file+'.pre_script'
-    logger.debug(name+' config: '+config_file)
-    # If we have an old back-up ask for the user to solve it
     if os.path.isfile(old_config_file):
         logger.error(name+' config back-up found (%s)', old_config_file)
-        logger.error('It could contain your %s configuration, rename it to %s or discard it.', name.lower(), config_file)
+        logger.error('It could contain your %s configuration, rename it to %s or discard it.', name.lower(), file)
         exit(err)
+    return old_config_file
+
+
+def backup_config(name, file, err, cfg):
+    config_file = file
+    logger.debug(name+' config: '+config_file)
+    old_config_file = check_config_backup(name, file, err)
     if os.path.isfile(config_file):
         logger.debug('Moving current config to '+old_config_file)
         os.rename(config_file, old_config_file)
@@ -212,9 +227,9 @@ def backup_config(name, file, err, cfg):
     return None
 
 
-def create_user_hotkeys(cfg):
+def create_user_hotkeys(cfg, fname=None):
     logger.debug('Creating a user hotkeys config')
-    with open(cfg.conf_hotkeys, "wt") as text_file:
+    with open(fname or cfg.conf_hotkeys, "wt") as text_file:
         text_file.write('common.Control.print\tCtrl+P\n')
         text_file.write('common.Control.plot\tCtrl+Shift+P\n')
         text_file.write('common.Control.show3DViewer\tAlt+3\n')
@@ -232,16 +247,20 @@ def create_user_hotkeys(cfg):
         text_file.write('3DViewer.Control.rotateZcounterclockwise\tAlt+Shift+Z\n')
 
 
-def create_kicad_config(cfg):
+def create_kicad_config(cfg, fname=None, old_conf=None):
+    """ Creates kicad_common (fname), old_conf is the user config with the environment vars """
     logger.debug('Creating a KiCad common config')
-    with open(cfg.conf_kicad, "wt") as text_file:
+    private = fname is not None
+    if not private:
+        fname, old_conf = cfg.conf_kicad, cfg.conf_kicad_bkp
+    with open(fname, "wt") as text_file:
         if cfg.conf_kicad_json:
             kiconf = {"environment": {"show_warning_dialog": False}}
             kiconf['graphics'] = {"cairo_antialiasing_mode": 0, "opengl_antialiasing_mode": 0}
             kiconf['system'] = {"editor_name": "/bin/cat"}
             # Copy the environment vars if available
-            if cfg.conf_kicad_bkp:
-                vars = Config.get_config_vars_json(cfg.conf_kicad_bkp)
+            if old_conf:
+                vars = Config.get_config_vars_json(old_conf)
                 if vars:
                     kiconf['environment']['vars'] = vars
             text_file.write(json.dumps(kiconf))
@@ -250,12 +269,148 @@ def create_kicad_config(cfg):
             text_file.write('ShowEnvVarWarningDialog=0\n')
             text_file.write('Editor=/bin/cat\n')
             # Copy the environment vars if available
-            if cfg.conf_kicad_bkp:
-                vars = Config.get_config_vars_ini(cfg.conf_kicad_bkp)
+            if old_conf:
+                vars = Config.get_config_vars_ini(old_conf)
                 if vars:
                     text_file.write('[EnvironmentVariables]\n')
                     for key in vars:
-                        text_file.write(key.upper()+'='+vars[key]+'\n')
+                        # A private copy must not redirect KiCad 5 to the user config
+                        if key.upper() != 'KICAD_CONFIG_HOME' or not private:
+                            text_file.write(key.upper()+'='+vars[key]+'\n')
+
+
+def config_overlay_dir():
+    """ Where we keep the templates and the private configs, tmpfs if available """
+    base = '/dev/shm'
+    if not os.path.isdir(base) or not os.access(base, os.W_OK | os.X_OK):
+        base = gettempdir()
+    return os.path.join(base, 'kiauto_config_{}'.format(os.getuid()))
+
+
+def config_signature(path):
+    """ Changes when the user config changes (or when we create a different template) """
+    h = hashlib.sha1(__version__.encode())
+    for root, dirs, files in os.walk(path):
+        dirs.sort()
+        for f in sorted(files):
+            if f.endswith(CONFIG_IGNORE):
+                continue
+            fname = os.path.join(root, f)
+            try:
+                st = os.stat(fname)
+            except OSError:
+                continue
+            h.update('{} {} {}\n'.format(os.path.relpath(fname, path), st.st_size, st.st_mtime_ns).encode())
+    return h.hexdigest()[:12]
+
+
+def create_config_template(cfg, base):
+    """ A copy of the user config containing our kicad_common, hotkeys and lib tables.
+        Shared by all the jobs using the same KiCad and config, rebuilt when the user config changes. """
+    src = cfg.kicad_conf_path
+    os.makedirs(base, exist_ok=True)
+    prefix = '{}_{}_'.format(cfg.kicad_version, hashlib.sha1(src.encode()).hexdigest()[:8])
+    template = os.path.join(base, prefix+config_signature(src))
+    if os.path.isdir(template):
+        return template
+    logger.debug('Creating a config template from '+src)
+    tmp = mkdtemp(prefix='tmp_', dir=base)
+    dest = os.path.join(tmp, 'config')
+    if os.path.isdir(src):
+        shutil.copytree(src, dest, symlinks=True, ignore=shutil.ignore_patterns(*['*'+e for e in CONFIG_IGNORE]))
+    else:
+        os.makedirs(dest)
+    create_kicad_config(cfg, os.path.join(dest, os.path.basename(cfg.conf_kicad)),
+                        cfg.conf_kicad if os.path.isfile(cfg.conf_kicad) else None)
+    if not cfg.ki5:
+        create_user_hotkeys(cfg, os.path.join(dest, os.path.basename(cfg.conf_hotkeys)))
+    check_lib_table(os.path.join(dest, 'sym-lib-table'), cfg.sys_sym_lib_table, remove_at_exit=False)
+    check_lib_table(os.path.join(dest, 'fp-lib-table'), cfg.sys_fp_lib_table, remove_at_exit=False)
+    # copytree used the mtime of the user config, we use it to remove old templates
+    os.utime(dest)
+    try:
+        os.rename(dest, template)
+    except OSError:
+        # Another job created it first
+        if not os.path.isdir(template):
+            raise
+    shutil.rmtree(tmp, ignore_errors=True)
+    # Templates for older versions of the user config
+    now = time.time()
+    for f in os.listdir(base):
+        old = os.path.join(base, f)
+        if f.startswith(prefix) and old != template and now-os.path.getmtime(old) > OLD_TEMPLATE:
+            shutil.rmtree(old, ignore_errors=True)
+    return template
+
+
+def remove_config_overlay(home):
+    shutil.rmtree(home, ignore_errors=True)
+
+
+def job_owner():
+    """ Identifies this process, the pid alone could be reused """
+    pid = os.getpid()
+    return '{} {}'.format(pid, psutil.Process(pid).create_time())
+
+
+def job_alive(owner):
+    try:
+        pid, created = owner.split()
+        return '{} {}'.format(pid, psutil.Process(int(pid)).create_time()) == owner
+    except (ValueError, psutil.Error):
+        return False
+
+
+def remove_stale_jobs(base):
+    """ Private configs left by killed jobs (atexit didn't run).
+        The job stores its owner, if missing (killed before writing it) we use the age. """
+    now = time.time()
+    for f in os.listdir(base):
+        if not f.startswith(('job_', 'tmp_')):
+            continue
+        job = os.path.join(base, f)
+        try:
+            with open(os.path.join(job, JOB_OWNER), 'rt') as fo:
+                stale = not job_alive(fo.read())
+        except OSError:
+            try:
+                stale = now-os.path.getmtime(job) > OLD_TEMPLATE
+            except OSError:
+                # Already removed
+                continue
+        if stale:
+            logger.debug('Removing stale job config '+job)
+            shutil.rmtree(job, ignore_errors=True)
+
+
+def setup_config_overlay(cfg, backups):
+    """ Makes KiCad use a private copy of the config (KICAD_CONFIG_HOME), so we don't touch the user files and
+        concurrent jobs don't interfere. Returns False if not possible, then we must back-up the user config.
+        backups are the (name, file, error) we back-up in this case, a back-up left by an old run is the user config. """
+    for name, file, err in backups:
+        if file:
+            check_config_backup(name, file, err)
+    if os.environ.get('KIAUTO_NO_CONFIG_OVERLAY'):
+        return False
+    base = config_overlay_dir()
+    try:
+        template = create_config_template(cfg, base)
+        remove_stale_jobs(base)
+        home = mkdtemp(prefix='job_', dir=base)
+        atexit.register(remove_config_overlay, home)
+        with open(os.path.join(home, JOB_OWNER), 'wt') as f:
+            f.write(job_owner())
+        # KiCad 6 adds the version to KICAD_CONFIG_HOME
+        dest = os.path.join(home, 'kicad' if cfg.ki5 else os.path.basename(cfg.kicad_conf_path))
+        shutil.copytree(template, dest, symlinks=True)
+    except OSError as e:
+        logger.warning('Unable to create a private KiCad config ({}), using the user config'.format(e))
+        return False
+    os.environ['KICAD_CONFIG_HOME'] = dest if cfg.ki5 else home
+    cfg.set_conf_path(dest)
+    logger.debug('Using a private KiCad config: '+dest)
+    return True
 
 
 def restore_autosave(name):
@@ -364,7 +519,12 @@ def get_log_files(out_dir, app_name, also_interposer=False):
     if also_interposer:
         os.makedirs(out_dir, exist_ok=True)
         fname = os.path.join(out_dir, app_name+'_interposer.log')
-        flog_int = open(fname, 'wt')
+        if os.environ.get('KIAUTO_INTERPOSER_LOG_GZ'):
+            # Long runs with the I/O log enabled generate big logs
+            fname += '.gz'
+            flog_int = gzip.open(fname, 'wt')
+        else:
+            flog_int = open(fname, 'wt')
         logger.debug('Saving '+app_name+' interposer dialog to '+fname)
     else:
         flog_int = DEVNULL
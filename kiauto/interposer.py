@@ -4,47 +4,263 @@
 # License: Apache 2.0
 # Project: KiAuto (formerly kicad-automation-scripts)
 import atexit
+from collections import deque
+from contextlib import contextmanager
+from functools import lru_cache
 import os
 import platform
 import psutil
 from queue import Queue, Empty
 import re
 import shutil
+import signal
 from sys import exit
-from tempfile import mkdtemp
+from tempfile import mkdtemp, gettempdir
 from threading import Thread
 import time
 from kiauto.misc import KICAD_DIED, CORRUPTED_PCB, PCBNEW_ERROR, EESCHEMA_ERROR
 from kiauto import log
+from kiauto.interposer_ring import InterposerRing, enqueue_ring
+from kiauto.startup import write_startup_profile
+from kiauto.timings import Timings, Phase, default_file as default_timings_file
+from kiauto.trace import Trace, traced
 from kiauto.ui_automation import xdotool, wait_for_window, wait_point, text_replace
 
 KICAD_EXIT_MSG = '>>exit<<'
 INTERPOSER_OPS = 'interposer_options.txt'
+INTERPOSER_FILENAME = 'interposer_filename.txt'
+INTERPOSER_REMAP = 'remap.txt'
+INTERPOSER_DIALOGS = 'dialogs.txt'
 IGNORED_DIALOG_MSGS = {'The quick brown fox jumps over the lazy dog.', '0123456789'}
 BOGUS_FILENAME = '#'
 # These dialogs are asynchronous, they can pop-up at anytime.
 # One example is when the .kicad_wks is missing, KiCad starts drawing and then detects it.
 INFO_DIALOGS = {'KiCad PCB Editor Information', 'KiCad Schematic Editor Information'}
-
-
-def check_interposer(args, logger, cfg):
-    # Name of the interposer library
-    interposer_lib = os.path.abspath(os.path.join(os.path.dirname(__file__), 'interposer', 'libinterposer.so'))
+# The GUI thread is blocked waiting for events, or it woke up
+MAIN_IDLE = 'GTK:Main:Idle'
+MAIN_BUSY = 'GTK:Main:Busy'
+# OpenGL frames: "GLX:Swap FRAME START_US DURATION_US" and no frames for KIAUTO_INTERPOSER_SETTLE ms
+SWAP_MSG = 'GLX:Swap'
+SETTLED_MSG = 'GLX:Settled'
+CAPTURED_MSG = 'GLX:Captured:'
+SWAP_RE = re.compile(r'GLX:Swap (\d+) (\d+) (\d+)')
+# Interposer dialog lines kept in memory, the rest is only in the log
+DIALOG_RECENT = 2000
+# Prefixes of the lines sent by the interposer
+INTERPOSER_PREFIXES = ('PANGO:', 'GTK:', 'IO:', 'GLX:', '* ')
+# Timeout for the interposer waits when we don't know how much the phase takes (s)
+DEFAULT_TIMEOUT = 300
+# Tests reported by the DRC/ERC while running (i.e. "Checking track & via clearances...")
+CHECK_PHASE = r'(.*\.\.\.)$'
+# Progress bars: "GTK:Progress:WINDOW_TITLE PERCENT" when the percent changes, "GTK:Progress End:WINDOW_TITLE" when the
+# window is destroyed
+PROGRESS_MSG = 'GTK:Progress:'
+PROGRESS_END_MSG = 'GTK:Progress End:'
+# Dialogs answered by the interposer: "GTK:Dialog Auto:TITLE|BUTTON|TEXT1|TEXT2..."
+DIALOG_AUTO_MSG = 'GTK:Dialog Auto:'
+# The interposer couldn't answer the dialog, we must do it
+DIALOG_NO_BUTTON_RE = re.compile(r'\* No `[^`]*` button in the `(.*)` dialog$')
+# Time stamp and thread id added to the interposer lines when tracing
+STAMP_RE = re.compile(r'@(\d+) (\d+) ')
+# Expected, no need to inform their content
+QUIET_AUTO_DIALOGS = {'Save Changes?'}
+
+
+def interposer_profile(args, cfg):
+    """ The library variant with the hooks needed by this command (see interposer/Makefile) """
+    profile = os.environ.get('KIAUTO_INTERPOSER_PROFILE')
+    if profile:
+        return profile
+    if getattr(args, 'startup_profile', None) or os.environ.get('KIAUTO_STARTUP_PROFILE'):
+        # The only variant hooking dlopen, it changes the RUNPATH used to load the libraries
+        return 'startup'
+    if not cfg.is_pcbnew:
+        return 'sch'
+    return 'pcb3d' if getattr(args, 'command', None) == '3d_view' else 'pcb'
+
+
+def interposer_lib_path(profile):
+    """ Name of the interposer library, the full one when the variant isn't available.
+        None if we can't use it """
+    lib_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), 'interposer'))
+    interposer_lib = os.path.join(lib_dir, 'libinterposer-{}.so'.format(profile))
+    if not os.path.isfile(interposer_lib):
+        interposer_lib = os.path.join(lib_dir, 'libinterposer.so')
     if (not os.path.isfile(interposer_lib) or  # The lib isn't there
-       args.disable_interposer or              # The user disabled it
        os.environ.get('KIAUTO_INTERPOSER_DISABLE') or  # The user disabled it using the environment
        platform.system() != 'Linux' or 'x86_64' not in platform.platform()):  # Not Linux 64 bits x86
-        interposer_lib = None
-    else:
-        os.environ['LD_PRELOAD'] = interposer_lib
+        return None
+    return interposer_lib
+
+
+def interposer_env(interposer_lib, kicad):
+    """ Environment needed to load the interposer """
+    lib_dir = os.path.dirname(interposer_lib)
+    return {'LD_PRELOAD': interposer_lib,
+            # Rules to add accelerators, they depend on the KiCad version
+            'KIAUTO_INTERPOSER_REMAP': os.path.join(lib_dir, INTERPOSER_REMAP),
+            'KIAUTO_INTERPOSER_KICAD': str(kicad),
+            # Dialogs answered by the interposer
+            'KIAUTO_INTERPOSER_DIALOGS': os.path.join(lib_dir, INTERPOSER_DIALOGS)}
+
+
+def check_interposer(args, logger, cfg):
+    interposer_lib = None if args.disable_interposer else interposer_lib_path(interposer_profile(args, cfg))
+    if interposer_lib:
         logger.debug('** Using interposer: '+interposer_lib)
+        kicad = 5 if cfg.ki5 else max(cfg.kicad_version_major, 6)
+        env = interposer_env(interposer_lib, kicad)
+        os.environ.update(env)
+        cfg.auto_dialogs, cfg.auto_dialogs_prefixes = load_auto_dialogs(env['KIAUTO_INTERPOSER_DIALOGS'], kicad)
+    else:
+        cfg.auto_dialogs = set()
+        cfg.auto_dialogs_prefixes = ()
+    cfg.interposer_ring = None
+    cfg.kicad_rt = None
+    if interposer_lib and (args.interposer_ring or os.environ.get('KIAUTO_INTERPOSER_USE_RING')):
+        # Get the events using shared memory instead of stdout
+        cfg.interposer_ring = InterposerRing(logger)
+        os.environ['KIAUTO_INTERPOSER_RING'] = cfg.interposer_ring.name
+        atexit.register(cfg.interposer_ring.close)
+    else:
+        os.environ.pop('KIAUTO_INTERPOSER_RING', None)
+    # Enabled by the commands that use the 3D viewer
+    os.environ.pop('KIAUTO_INTERPOSER_SETTLE', None)
+    # Chrome/Perfetto trace
+    trace = args.trace[0] if getattr(args, 'trace', None) else os.environ.get('KIAUTO_TRACE')
+    if trace:
+        cfg.trace = Trace(os.path.abspath(trace), logger)
+        atexit.register(cfg.trace.write)
+        os.environ['KIAUTO_INTERPOSER_TIMESTAMPS'] = '1'
+    else:
+        cfg.trace = None
+        os.environ.pop('KIAUTO_INTERPOSER_TIMESTAMPS', None)
+    # Hooks latency histograms, written by the interposer when KiCad exits
+    cfg.keep_interposer_stats = bool(os.environ.get('KIAUTO_INTERPOSER_STATS'))
+    if interposer_lib:
+        if cfg.keep_interposer_stats:
+            # The user wants the file
+            cfg.interposer_stats = os.path.abspath(os.environ['KIAUTO_INTERPOSER_STATS'])
+        else:
+            cfg.interposer_stats = os.path.join(gettempdir(), 'kiauto_interposer_stats_{}.txt'.format(os.getpid()))
+            atexit.register(remove_interposer_stats, cfg)
+        os.environ['KIAUTO_INTERPOSER_STATS'] = cfg.interposer_stats
+    else:
+        cfg.interposer_stats = None
+        os.environ.pop('KIAUTO_INTERPOSER_STATS', None)
+    # Start-up profile, the interposer stores the raw data when KiCad enters the main loop
+    profile = (args.startup_profile[0] if getattr(args, 'startup_profile', None) else
+               os.environ.get('KIAUTO_STARTUP_PROFILE'))
+    if interposer_lib and profile:
+        cfg.startup_profile = os.path.abspath(profile)
+        cfg.startup_raw = os.path.join(gettempdir(), 'kiauto_startup_{}.txt'.format(os.getpid()))
+        os.environ['KIAUTO_INTERPOSER_STARTUP'] = cfg.startup_raw
+    else:
+        cfg.startup_profile = cfg.startup_raw = None
+        os.environ.pop('KIAUTO_INTERPOSER_STARTUP', None)
+    # Phase durations, used to compute the timeouts. Not when a human is involved.
+    cfg.phase = None
+    if interposer_lib and not os.environ.get('KIAUTO_NO_TIMINGS') and not cfg.start_x11vnc and not cfg.wait_for_key:
+        cfg.timings = Timings(os.environ.get('KIAUTO_TIMINGS') or default_timings_file(), logger)
+        cfg.timings.set_job(('pcbnew ' if cfg.is_pcbnew else 'eeschema ')+args.command, cfg.input_file)
+        atexit.register(cfg.timings.save)
+    else:
+        cfg.timings = None
+    # Only used by the worker mode
+    cfg.interposer_filename_file = None
+    os.environ.pop('KIAUTO_INTERPOSER_FILENAME_FILE', None)
     cfg.use_interposer = interposer_lib
     cfg.enable_interposer = interposer_lib or args.interposer_sniff
     cfg.logger = logger
 
 
+def rule_version_ok(ver, kicad):
+    """ Version used by the interposer rules: * (all), N (just N) or N+ (N and newer) """
+    if ver == '*':
+        return True
+    if ver.endswith('+'):
+        return ver[:-1].isdigit() and kicad >= int(ver[:-1])
+    return ver.isdigit() and kicad == int(ver)
+
+
+def load_auto_dialogs(fname, kicad):
+    """ Titles of the dialogs answered by the interposer (see kiauto/interposer/dialogs.txt) """
+    exact = set()
+    prefixes = []
+    if not os.path.isfile(fname):
+        return exact, ()
+    with open(fname, 'rt') as f:
+        for ln in f:
+            ln = ln.rstrip('\n')
+            if not ln or ln[0] == '#':
+                continue
+            fields = ln.split('|', 3)
+            if len(fields) != 4 or fields[1] != 'dialog' or not rule_version_ok(fields[0], kicad):
+                continue
+            if fields[2].endswith('*'):
+                prefixes.append(fields[2][:-1])
+            else:
+                exact.add(fields[2])
+    return exact, tuple(prefixes)
+
+
+def is_auto_dialog(cfg, title):
+    return title in cfg.auto_dialogs or (cfg.auto_dialogs_prefixes and title.startswith(cfg.auto_dialogs_prefixes))
+
+
+def log_auto_dialog(cfg, text):
+    """ A dialog was answered by the interposer, inform its content """
+    fields = text.split('|')
+    title = fields[0]
+    button = fields[1] if len(fields) > 1 else ''
+    msgs = [m for m in fields[2:] if m not in IGNORED_DIALOG_MSGS and m != title]
+    cfg.logger.debug('Dialog `{}` answered by the interposer ({}): {}'.format(title, button or 'closed', msgs))
+    if title in QUIET_AUTO_DIALOGS:
+        return
+    if title == 'Remap Symbols':
+        cfg.logger.warning('Schematic needs update')
+        return
+    for msg in msgs:
+        if msg.startswith("Drawing sheet ") and msg.endswith(" not found."):
+            cfg.logger.warning("Missing worksheet file (.kicad_wks)")
+        cfg.logger.warning(msg)
+
+
+class InterposerDialog(object):
+    """ The dialog with the interposer.
+        All the lines are written to the log as we get them, only the most recent are kept in memory """
+    def __init__(self, f, size=DIALOG_RECENT):
+        self.f = f if hasattr(f, 'write') else None
+        self.recent = deque(maxlen=size)
+        self.lines = 0
+
+    def append(self, line):
+        self.recent.append(line)
+        self.lines += 1
+        if self.f is not None:
+            self.f.write(line+'\n')
+
+    def clear(self):
+        """ Start a new section, the log isn't affected """
+        self.recent.clear()
+
+    def __iter__(self):
+        return iter(self.recent)
+
+    def __len__(self):
+        return len(self.recent)
+
+
+def log_recent_dialog(cfg, lines=20):
+    """ Helps to know what happened before an error """
+    recent = list(cfg.interposer_dialog)[-lines:]
+    if recent:
+        cfg.logger.debug('Last interposer lines:\n'+'\n'.join(recent))
+
+
 def dump_interposer_dialog(cfg):
-    cfg.logger.debug('Storing interposer dialog ({})'.format(cfg.flog_int.name))
+    """ The lines are already in the log, add the pending lines and close it """
+    cfg.logger.debug('Storing interposer dialog ({}, {} lines)'.format(cfg.flog_int.name, cfg.interposer_dialog.lines))
     if cfg.enable_interposer and not cfg.use_interposer:
         try:
             while True:
@@ -57,11 +273,39 @@ def dump_interposer_dialog(cfg):
                 cfg.interposer_dialog.append('>>Interposer<<:{} (@{} D {})'.format(line[:-1], round(tm, 3), round(diff, 3)))
         except Empty:
             pass
-    for ln in cfg.interposer_dialog:
-        cfg.flog_int.write(ln+'\n')
+    stats = store_interposer_reports(cfg)
+    if stats:
+        cfg.interposer_dialog.append('>>Interposer stats<<\n'+stats)
     cfg.flog_int.close()
 
 
+def store_interposer_reports(cfg):
+    """ Logs the hooks statistics (returned) and stores the start-up profile, once KiCad finished """
+    stats = read_interposer_stats(cfg)
+    if stats:
+        cfg.logger.debug('Interposer hooks statistics:\n'+stats)
+    write_startup_profile(cfg)
+    return stats
+
+
+def read_interposer_stats(cfg):
+    """ The hooks statistics, only available if KiCad exited normally """
+    fname = getattr(cfg, 'interposer_stats', None)
+    if not fname or not os.path.isfile(fname):
+        return None
+    with open(fname, 'rt') as f:
+        stats = f.read().rstrip()
+    if not cfg.keep_interposer_stats:
+        # The next run of KiCad (i.e. retries) will create a new one
+        os.remove(fname)
+    return stats
+
+
+def remove_interposer_stats(cfg):
+    if os.path.isfile(cfg.interposer_stats):
+        os.remove(cfg.interposer_stats)
+
+
 def remove_interposer_print_dir(cfg):
     cfg.logger.debug('Removing temporal dir '+cfg.interposer_print_dir)
     shutil.rmtree(cfg.interposer_print_dir, ignore_errors=True)
@@ -77,6 +321,20 @@ def create_interposer_print_options_file(cfg):
     atexit.register(remove_interposer_print_dir, cfg)
 
 
+def create_interposer_filename_file(cfg):
+    """ Creates a temporal holder for the file name used by the file choosers.
+        The interposer reads it every time, so we can change it for each job (worker mode) """
+    cfg.interposer_filename_dir = mkdtemp()
+    cfg.interposer_filename_file = os.path.join(cfg.interposer_filename_dir, INTERPOSER_FILENAME)
+    cfg.logger.debug('Using temporal file {} for interposer file names'.format(cfg.interposer_filename_file))
+    open(cfg.interposer_filename_file, 'wt').close()
+    os.environ['KIAUTO_INTERPOSER_FILENAME_FILE'] = cfg.interposer_filename_file
+    os.environ.pop('KIAUTO_INTERPOSER_FILENAME', None)
+    # We don't know the name of the outputs in advance
+    os.environ.pop('KIAUTO_INTERPOSER_WATCH', None)
+    atexit.register(shutil.rmtree, cfg.interposer_filename_dir, ignore_errors=True)
+
+
 def save_interposer_print_data(cfg, tmpdir, fn, ext):
     """ Write the print options to the created file """
     with open(cfg.interposer_print_file, 'wt') as f:
@@ -92,15 +350,22 @@ def save_interposer_print_data(cfg, tmpdir, fn, ext):
 #         cfg.kicad_q.queue.clear()
 
 
-def enqueue_output(out, queue):
+def enqueue_output(out, queue, trace=None):
     """ Read 1 line from the interposer and add it to the queue.
         Notes:
         * The queue is thread safe.
-        * When we get an empty string we finish, this is the case for KiCad finished """
+        * When we get an empty string we finish, this is the case for KiCad finished
+        * When tracing the lines have a time stamp and a thread id: "@NS TID EVENT" """
     tm_start = time.time()
     for line in iter(out.readline, ''):
-        if (line.startswith('PANGO:') or line.startswith('GTK:') or line.startswith('IO:') or line.startswith('GLX:') or
-           line.startswith('* ')):
+        if line[0] == '@' and trace is not None:
+            # Other messages could start with @, they are passed unchanged
+            m = STAMP_RE.match(line)
+            if m:
+                line = line[m.end():]
+                if line.startswith(INTERPOSER_PREFIXES):
+                    trace.interposer_event(int(m.group(1)), int(m.group(2)), line[:-1])
+        if line.startswith(INTERPOSER_PREFIXES):
             queue.put((time.time()-tm_start, line))
         # logger.error((time.time()-tm_start, line))
     out.close()
@@ -114,14 +379,37 @@ def start_queue(cfg):
         return
     cfg.logger.debug('Starting queue thread')
     cfg.kicad_q = Queue()
+    # Used by the start-up profile
+    cfg.kicad_launch_ns = getattr(cfg.popen_obj, 'start_ns', None)
     # Avoid crashes when KiCad 5 sends an invalid Unicode sequence
     cfg.popen_obj.stdout.reconfigure(errors='ignore')
-    cfg.kicad_t = Thread(target=enqueue_output, args=(cfg.popen_obj.stdout, cfg.kicad_q))
+    if cfg.trace is not None:
+        cfg.trace.set_kicad_pid(cfg.popen_obj.pid, os.path.basename(cfg.popen_obj.args[0]))
+        if cfg.interposer_ring is not None:
+            cfg.interposer_ring.trace = cfg.trace
+    cfg.kicad_t = Thread(target=enqueue_output, args=(cfg.popen_obj.stdout, cfg.kicad_q, cfg.trace))
     cfg.kicad_t.daemon = True   # thread dies with the program
     cfg.kicad_t.start()
+    if cfg.interposer_ring is not None:
+        # The stdout thread is still used for the messages sent when the ring isn't available
+        if cfg.kicad_rt is not None:
+            # Previous try, KiCad is dead, so this is fast
+            cfg.kicad_rt.join()
+        cfg.interposer_ring.tm_start = time.monotonic_ns()
+        cfg.kicad_rt = Thread(target=enqueue_ring, args=(cfg.interposer_ring, cfg.popen_obj, cfg.kicad_q))
+        cfg.kicad_rt.daemon = True
+        cfg.kicad_rt.start()
     cfg.collecting_io = False
     cfg.last_msg_time = 0
-    cfg.interposer_dialog = []
+    cfg.interposer_dialog = InterposerDialog(cfg.flog_int)
+    # We get the main loop state once KiCad enters gtk_main
+    cfg.idle_events = False
+    cfg.kicad_idle = False
+    # Start and duration of the OpenGL frames (us)
+    cfg.frames = []
+    cfg.render_settled = False
+    # Last frames reported as settled and stored by the interposer (direct capture)
+    cfg.settled_frame = cfg.captured_frame = -1
 
 
 def collect_io_from_queue(cfg):
@@ -129,13 +417,121 @@ def collect_io_from_queue(cfg):
     cfg.collecting_io = True
 
 
-def wait_queue(cfg, strs='', starts=False, times=1, timeout=300, do_to=True, kicad_can_exit=False, with_windows=False):
-    """ Wait for a string in the queue """
+class WaitMatcher(object):
+    """ The strings we are waiting for, compiled to match a line using one call """
+    __slots__ = ('any', 'exact', 'prefixes')
+
+    def __init__(self, strs, starts, prefixes=()):
+        # An empty string means any line
+        self.any = '' in strs
+        strs = tuple(s for s in strs if s)
+        self.exact = frozenset() if starts else frozenset(strs)
+        self.prefixes = (strs if starts else ())+prefixes
+
+    def match(self, line):
+        return line in self.exact or (self.prefixes and line.startswith(self.prefixes))
+
+
+@lru_cache(maxsize=64)
+def get_wait_matcher(strs, starts, prefixes=()):
+    return WaitMatcher(strs, starts, prefixes)
+
+
+def process_event(cfg, tm, line):
+    """ Updates the KiCad state using an interposer event (without the EOL).
+        Returns the line, or an empty string if we must ignore it """
+    if cfg.verbose > 1:
+        tm *= 1000
+        diff = 0
+        if cfg.last_msg_time:
+            diff = tm-cfg.last_msg_time
+        cfg.last_msg_time = tm
+        cfg.logger.debug('>>Interposer<<:{} (@{} D {})'.format(line, round(tm, 3), round(diff, 3)))
+    cfg.interposer_dialog.append(line)
+    if line.startswith('IO:'):
+        # The I/O can be in parallel to the UI
+        if cfg.collecting_io:
+            cfg.collected_io.add(line)
+    elif line == MAIN_IDLE:
+        cfg.kicad_idle = cfg.idle_events = True
+    elif line == MAIN_BUSY:
+        cfg.kicad_idle = False
+    elif line.startswith(SWAP_MSG):
+        cfg.render_settled = False
+        m = SWAP_RE.match(line)
+        if m:
+            cfg.frames.append((int(m.group(2)), int(m.group(3))))
+    elif line.startswith(SETTLED_MSG):
+        cfg.render_settled = True
+        cfg.settled_frame = int(line[len(SETTLED_MSG):])
+    elif line.startswith(CAPTURED_MSG):
+        cfg.captured_frame = int(line.rsplit(' ', 1)[1])
+    elif line.startswith('GTK:Window Title:') and is_auto_dialog(cfg, line[17:]):
+        # The interposer will answer it, we don't need to know about it
+        return ''
+    elif line.startswith(DIALOG_AUTO_MSG):
+        log_auto_dialog(cfg, line[len(DIALOG_AUTO_MSG):])
+    elif line.startswith('* No `'):
+        m = DIALOG_NO_BUTTON_RE.match(line)
+        if m:
+            # The interposer failed to answer it, we ignored the title, so we report it now
+            cfg.logger.debug('The interposer failed to answer the `{}` dialog'.format(m.group(1)))
+            return 'GTK:Window Title:'+m.group(1)
+    return line
+
+
+def unexpected_window(cfg, line, with_windows, kicad_can_exit):
+    """ The title of a window we aren't expecting, or None """
+    if (not with_windows and not kicad_can_exit and line.startswith('GTK:Window Title:') and
+        # The change in the unsaved status is ignored here
+       not(not cfg.ki5 and line.endswith(cfg.window_title_end))):
+        # We aren't expecting a window, but something seems to be there
+        # Note that window title change is normal when we expect KiCad exiting
+        return line[17:]
+    return None
+
+
+@contextmanager
+def phase(cfg, name):
+    """ A step of the run (i.e. a dialog). The waits that can time out must finish before a deadline computed from
+        the duration of this phase in previous runs. The duration is stored when the phase succeeds.
+        The progress reported by KiCad extends the deadline (see wait_and_show_progress). """
+    timings = getattr(cfg, 'timings', None)
+    trace = getattr(cfg, 'trace', None)
+    start_ns = time.monotonic_ns()
+    start = time.time()
+    outer = getattr(cfg, 'phase', None)
+    if timings is not None:
+        cfg.phase = Phase(name, timings.timeout(name, DEFAULT_TIMEOUT*cfg.time_out_scale), outer, start)
+    try:
+        yield
+        if timings is not None:
+            timings.add(name, time.time()-start)
+    finally:
+        cfg.phase = outer
+        if trace is not None:
+            trace.span(name, start_ns)
+
+
+@traced
+def wait_queue(cfg, strs='', starts=False, times=1, timeout=None, do_to=True, kicad_can_exit=False, with_windows=False,
+               prefixes=()):
+    """ Wait for a string in the queue.
+        The default timeout is the deadline for the current phase (see phase()), or DEFAULT_TIMEOUT.
+        We only apply the phase deadline to the waits that raise an exception.
+        prefixes: Strings that match the beginning of the line, even when starts is False """
     if not cfg.use_interposer:
         return None
     if isinstance(strs, str):
         strs = [strs]
-    end_time = time.time()+timeout*cfg.time_out_scale
+    matcher = get_wait_matcher(tuple(strs), starts, tuple(prefixes))
+    cur_phase = getattr(cfg, 'phase', None) if do_to else None
+    if cur_phase is not None and timeout is None:
+        end_time = cur_phase.end
+    else:
+        end_time = time.time()+(DEFAULT_TIMEOUT if timeout is None else timeout)*cfg.time_out_scale
+        if cur_phase is not None:
+            end_time = min(end_time, cur_phase.end)
     msg = 'Waiting for `{}` starts={} times={}'.format(strs, starts, times)
     cfg.interposer_dialog.append('KiAuto:'+msg)
     if cfg.verbose > 1:
@@ -143,52 +539,30 @@ def wait_queue(cfg, strs='', starts=False, times=1, timeout=300, do_to=True, kic
     while time.time() < end_time:
         try:
             tm, line = cfg.kicad_q.get(timeout=.1)
-            line = line[:-1]
-            if cfg.verbose > 1:
-                tm *= 1000
-                diff = 0
-                if cfg.last_msg_time:
-                    diff = tm-cfg.last_msg_time
-                cfg.last_msg_time = tm
-                cfg.logger.debug('>>Interposer<<:{} (@{} D {})'.format(line, round(tm, 3), round(diff, 3)))
-            cfg.interposer_dialog.append(line)
-            # The I/O can be in parallel to the UI
-            if cfg.collecting_io and line.startswith('IO:'):
-                cfg.collected_io.add(line)
+            line = process_event(cfg, tm, line[:-1])
         except Empty:
             line = ''
         if line == '' and cfg.popen_obj.poll() is not None:
             if kicad_can_exit:
                 return KICAD_EXIT_MSG
+            log_recent_dialog(cfg)
             cfg.logger.error('KiCad unexpectedly died (error level {})'.format(cfg.popen_obj.poll()))
             exit(KICAD_DIED)
-        old_times = times
-        for s in strs:
-            if s == '':
-                # Waiting for anything ... but not for nothing
-                if line != '':
-                    return line
-                continue
-            if starts:
-                if line.startswith(s):
-                    times -= 1
-                    break
-            elif line == s:
-                times -= 1
-                break
-        if times == 0:
-            cfg.interposer_dialog.append('KiAuto:match')
-            cfg.logger.debug('Interposer match: '+line)
+        if line == '':
+            continue
+        if matcher.any:
+            # Waiting for anything ... but not for nothing
             return line
-        if old_times != times:
+        if matcher.match(line):
+            times -= 1
+            if times == 0:
+                cfg.interposer_dialog.append('KiAuto:match')
+                cfg.logger.debug('Interposer match: '+line)
+                return line
             cfg.interposer_dialog.append('KiAuto:times '+str(times))
             cfg.logger.debug('Interposer match, times='+str(times))
-        if (not with_windows and not kicad_can_exit and line.startswith('GTK:Window Title:') and
-            # The change in the unsaved status is ignored here
-           not(not cfg.ki5 and line.endswith(cfg.window_title_end))):
-            # We aren't expecting a window, but something seems to be there
-            # Note that window title change is normal when we expect KiCad exiting
-            title = line[17:]
+        title = unexpected_window(cfg, line, with_windows, kicad_can_exit)
+        if title is not None:
             if title in INFO_DIALOGS:
                 # Async dialogs
                 dismiss_pcb_info(cfg, title)
@@ -198,6 +572,10 @@ def wait_queue(cfg, strs='', starts=False, times=1, timeout=300, do_to=True, kic
             else:
                 unknown_dialog(cfg, title)
     if do_to:
+        if cur_phase is not None and end_time == cur_phase.end:
+            ph = cur_phase.limiting()
+            raise RuntimeError('Timed out waiting for `{}`, the `{}` phase took more than {:.1f} s without progress'.
+                               format(strs, ph.name, ph.limit))
         raise RuntimeError('Timed out waiting for `{}`'.format(strs))
 
 
@@ -205,7 +583,37 @@ def wait_swap(cfg, times=1, kicad_can_exit=False):
     """ Wait an OpenGL draw (buffer swap) """
     if not cfg.use_interposer or not times:
         return None
-    return wait_queue(cfg, 'GLX:Swap', starts=True, times=times, kicad_can_exit=kicad_can_exit)
+    return wait_queue(cfg, SWAP_MSG, starts=True, times=times, kicad_can_exit=kicad_can_exit)
+
+
+def wait_render_settled_i(cfg, swaps=0):
+    """ Wait until the interposer reports no new frames for cfg.settle_time ms.
+        Without settle events we just wait for the swaps and KiCad sleeping """
+    if cfg.settle_time <= 0:
+        return wait_kicad_ready_i(cfg, swaps)
+    wait_swap(cfg, swaps)
+    # Pending messages can contain new frames
+    while not cfg.render_settled or not cfg.kicad_q.empty():
+        wait_queue(cfg, [SWAP_MSG, SETTLED_MSG], starts=True)
+    cfg.logger.debug('= Render settled')
+    return wait_kicad_ready_i(cfg)
+
+
+def percentile(values, p):
+    """ Nearest rank percentile, values must be sorted """
+    return values[min(len(values)-1, int(len(values)*p/100))]
+
+
+def log_frames_stats(cfg):
+    """ Summary of the OpenGL frames we saw """
+    frames = cfg.frames
+    if len(frames) < 2:
+        return
+    intervals = sorted((b[0]-a[0])/1000 for a, b in zip(frames, frames[1:]))
+    swaps = sorted(f[1]/1000 for f in frames)
+    cfg.logger.debug('Frames: {}, interval (ms) p50 {:.1f} p90 {:.1f} p99 {:.1f} max {:.1f}, swap (ms) p50 {:.1f} max {:.1f}'.
+                     format(len(frames), percentile(intervals, 50), percentile(intervals, 90), percentile(intervals, 99),
+                            intervals[-1], percentile(swaps, 50), swaps[-1]))
 
 
 def set_kicad_process(cfg, pid):
@@ -219,8 +627,34 @@ def set_kicad_process(cfg, pid):
         exit(1)
 
 
+def wait_kicad_idle_i(cfg, res, swaps, kicad_can_exit):
+    """ Wait until the interposer reports the GUI thread is waiting for events """
+    if cfg.kicad_idle and cfg.kicad_q.empty():
+        cfg.logger.debug('= KiCad already idle')
+        return res
+    if swaps:
+        cfg.logger.debug('= KiCad still running after {} swaps, waiting more'.format(swaps))
+    else:
+        cfg.logger.debug('= KiCad still running, waiting more')
+    # Pending messages can change the state, so we process all of them
+    while not cfg.kicad_idle or not cfg.kicad_q.empty():
+        new_res = wait_queue(cfg, [SWAP_MSG, MAIN_IDLE], starts=True, timeout=1, do_to=False,
+                             kicad_can_exit=kicad_can_exit)
+        if new_res == KICAD_EXIT_MSG:
+            cfg.logger.debug('= KiCad died')
+            return new_res
+        if new_res is not None and new_res.startswith(SWAP_MSG):
+            res = new_res
+    cfg.logger.debug('= KiCad finally idle')
+    return res
+
+
+@traced
 def wait_kicad_ready_i(cfg, swaps=0, kicad_can_exit=False):
     res = wait_swap(cfg, swaps, kicad_can_exit=kicad_can_exit)
+    if cfg.idle_events:
+        # The interposer informs the main loop state, no need to poll the process status
+        return wait_kicad_idle_i(cfg, res, swaps, kicad_can_exit)
     # KiCad 5 takes 0 to 2 extra swaps (is random) so here we ensure KiCad is sleeping
     status = cfg.kicad_process.status()
     if status != psutil.STATUS_SLEEPING:
@@ -230,7 +664,7 @@ def wait_kicad_ready_i(cfg, swaps=0, kicad_can_exit=False):
             cfg.logger.debug('= KiCad still running, waiting more')
         try:
             while cfg.kicad_process.status() != psutil.STATUS_SLEEPING:
-                new_res = wait_queue(cfg, 'GLX:Swap', starts=True, timeout=0.1, do_to=False, kicad_can_exit=kicad_can_exit)
+                new_res = wait_queue(cfg, SWAP_MSG, starts=True, timeout=0.1, do_to=False, kicad_can_exit=kicad_can_exit)
                 if new_res is not None:
                     res = new_res
         except psutil.NoSuchProcess:
@@ -242,7 +676,13 @@ def wait_kicad_ready_i(cfg, swaps=0, kicad_can_exit=False):
     return res
 
 
+@traced
 def open_dialog_i(cfg, name, keys, no_show=False, no_wait=False, no_main=False, extra_msg=None):
+    with phase(cfg, 'dialog '+(name if isinstance(name, str) else name[0])):
+        return _open_dialog_i(cfg, name, keys, no_show, no_wait, no_main, extra_msg)
+
+
+def _open_dialog_i(cfg, name, keys, no_show, no_wait, no_main, extra_msg):
     wait_point(cfg)
     # Wait for KiCad to be sleeping
     wait_kicad_ready_i(cfg)
@@ -256,12 +696,18 @@ def open_dialog_i(cfg, name, keys, no_show=False, no_wait=False, no_main=False,
         name = [name]
     name_w_pre = [pre_gtk+f for f in name]
     # Add the async dialogs
-    for t in INFO_DIALOGS:
-        name_w_pre.append(pre_gtk_title+t)
+    name_w_pre.extend(pre_gtk_title+t for t in INFO_DIALOGS)
+    # Answered by the interposer, but it could get our keys
+    auto_pres = [DIALOG_AUTO_MSG+t+'|' for t in INFO_DIALOGS]
     # Wait for our dialog or any async dialog
     # Note: wait_queue won't dismiss them because we use "with_windows=True"
     while True:
-        res = wait_queue(cfg, name_w_pre, with_windows=True)
+        res = wait_queue(cfg, name_w_pre, with_windows=True, prefixes=auto_pres)
+        if res.startswith(DIALOG_AUTO_MSG):
+            # Wait until the dialog is gone and send the keys again
+            wait_kicad_ready_i(cfg)
+            xdotool(keys)
+            continue
         title = res[len(pre_gtk_title):]
         if title not in INFO_DIALOGS:
             break
@@ -308,18 +754,43 @@ def paste_bogus_filename(cfg):
     paste_text_i(cfg, 'Paste bogus short name', BOGUS_FILENAME)
 
 
+def setup_interposer_watch(cfg, fn):
+    """ Defines the files we want to know about, the interposer won't report other I/O.
+        Use KIAUTO_INTERPOSER_WATCH_FILE pointing to a file containing * to see all. """
+    # The output file, the PCB when we save it and the temporal dirs (i.e. print)
+    watch = [fn, os.path.realpath(cfg.input_file), os.path.join(gettempdir(), '')]
+    if os.path.realpath(fn) != fn:
+        watch.append(os.path.realpath(fn))
+    if any(':' in f for f in watch):
+        # Can't be separated, just report everything
+        os.environ.pop('KIAUTO_INTERPOSER_WATCH', None)
+        return
+    os.environ['KIAUTO_INTERPOSER_WATCH'] = ':'.join(watch)
+    cfg.logger.debug('Interposer I/O watch list: '+os.environ['KIAUTO_INTERPOSER_WATCH'])
+
+
 def setup_interposer_filename(cfg, fn=None):
-    """ Defines the file name used by the interposer to fake the file choosers """
+    """ Defines the file name used by the interposer to fake the file choosers.
+        When KiCad is already running `fn` can be a list, each file chooser takes the next name """
     if not cfg.use_interposer:
         return
     if fn is None:
         fn = cfg.output_file
-    os.environ['KIAUTO_INTERPOSER_FILENAME'] = fn
+    names = [fn] if isinstance(fn, str) else fn
+    fn = names[0]
+    if cfg.interposer_filename_file:
+        # KiCad is already running
+        with open(cfg.interposer_filename_file, 'wt') as f:
+            f.write(''.join(n+'\n' for n in names))
+    else:
+        os.environ['KIAUTO_INTERPOSER_FILENAME'] = fn
+        setup_interposer_watch(cfg, fn)
     if os.path.isfile(BOGUS_FILENAME):
         cfg.logger.warning('Removing bogus file `{}`'.format(BOGUS_FILENAME))
         os.remove(BOGUS_FILENAME)
 
 
+@traced
 def send_keys(cfg, msg, keys, closes=None, delay_io=False):
     cfg.logger.info(msg)
     wait_point(cfg)
@@ -336,33 +807,42 @@ def send_keys(cfg, msg, keys, closes=None, delay_io=False):
         wait_kicad_ready_i(cfg)
 
 
+@traced
 def wait_create_i(cfg, name, fn=None):
-    """ Wait for open+close of the file.
-        Also look for them in the collected_io messages.
-        And if we just get close forget about the open. """
+    """ Wait for the interposer to report the file as complete (closed or renamed into place).
+        Also look for it in the collected_io messages.
+        The open and close are just informative. """
     cfg.logger.info('Wait for '+name+' file creation')
     wait_point(cfg)
     if fn is None:
         fn = cfg.output_file
     open_msg = 'IO:open:'+fn
-    close_msg = 'IO:close:'+fn
+    # The close and complete use the name from the kernel, symlinks resolved
+    real_fn = os.path.realpath(fn)
+    close_msg = 'IO:close:'+real_fn
+    complete_msg = 'IO:Complete:'+real_fn+' '
+    msg = None
     if cfg.collecting_io:
         cfg.collecting_io = False
-        got_open = open_msg in cfg.collected_io
-        got_close = close_msg in cfg.collected_io
-    else:
-        got_open = False
-        got_close = False
-    if got_open or got_close:
-        if got_open:
-            cfg.logger.debug('Found IO '+open_msg)
-    else:
-        msg = wait_queue(cfg, [open_msg, close_msg], starts=True)
-        got_close = msg.startswith(close_msg)
-    if got_close:
-        cfg.logger.debug('Found IO '+close_msg)
-    else:
-        wait_queue(cfg, close_msg, starts=True)
+        for line in cfg.collected_io:
+            if line.startswith(complete_msg):
+                msg = line
+            elif line == open_msg or line == close_msg:
+                cfg.logger.debug('Found IO '+line)
+    with phase(cfg, 'write '+name):
+        while msg is None:
+            res = wait_queue(cfg, [open_msg, close_msg, complete_msg], starts=True)
+            if res.startswith(complete_msg):
+                msg = res
+            else:
+                cfg.logger.debug('Found IO '+res)
+    size = int(msg[len(complete_msg):])
+    cfg.logger.debug('{} file complete ({} bytes)'.format(name, size))
+    if size == 0:
+        cfg.logger.error('KiCad created an empty {} file (`{}`)'.format(name, fn))
+        exit_pcb_ees_error(cfg)
+    if size < 0:
+        cfg.logger.warning('The {} file (`{}`) is no longer there'.format(name, fn))
     wait_kicad_ready_i(cfg)
 
 
@@ -523,6 +1003,7 @@ def dismiss_pcb_info(cfg, title):
 
 def exit_kicad_i(cfg):
     wait_kicad_ready_i(cfg)
+    log_frames_stats(cfg)
     send_keys(cfg, 'Exiting KiCad', 'ctrl+q')
     pre = 'GTK:Window Title:'
     pre_l = len(pre)
@@ -556,6 +1037,25 @@ def exit_kicad_i(cfg):
         xdotool(['key', 'ctrl+q'])
 
 
+def kill_kicad_i(cfg, reason):
+    """ Stop KiCad without the exit dialogs, we already have the results (i.e. --fail_fast) """
+    cfg.logger.info(reason+', stopping KiCad')
+    log_frames_stats(cfg)
+    try:
+        # The whole group, KiCad nightly uses a shell script
+        os.killpg(os.getpgid(cfg.kicad_process.pid), signal.SIGTERM)
+    except ProcessLookupError:
+        pass
+
+
+def end_job_i(cfg):
+    """ Exit KiCad, unless this is a worker waiting for more jobs """
+    if cfg.worker:
+        wait_kicad_ready_i(cfg)
+        return
+    exit_kicad_i(cfg)
+
+
 # def wait_close_dialog_i(cfg):
 #     """ Wait for the end of the main loop for the dialog.
 #         Then the main loop for the parent exits and enters again. """
@@ -563,17 +1063,26 @@ def exit_kicad_i(cfg):
 #     wait_queue(cfg, 'GTK:Main:In')
 
 
-def wait_and_show_progress(cfg, msg, regex_str, trigger, msg_reg, skip_match=None, with_windows=False):
+def progress_percent(res):
+    """ The percent from a PROGRESS_MSG line """
+    return res.rsplit(' ', 1)[-1]+'%'
+
+
+def wait_and_show_progress(cfg, msg, regex_str, trigger, msg_reg, skip_match=None, with_windows=False, progress=None):
     """ msg: The message we are waiting
         regex_str: A regex to extract the progress message (text after PANGO:)
         trigger: A text that must be start at the beginning to test using the regex (PANGO:trigger)
         msg_reg: Message to print before the info (msg_reg: MATCH)
         skip_match: A match that we will skip
-        with_windows: KiCad could pop-up a window """
+        with_windows: KiCad could pop-up a window
+        progress: Title of the window with a progress bar, its percent is added to the info """
     pres = [msg, 'PANGO:'+trigger]
+    if progress is not None:
+        pres.append(PROGRESS_MSG+progress+' ')
     regex = re.compile(regex_str)
     with_info = False
     padding = 80*' '
+    m = pct = None
     while True:
         res = wait_queue(cfg, pres, starts=True, with_windows=with_windows)
         if res.startswith(msg):
@@ -582,25 +1091,35 @@ def wait_and_show_progress(cfg, msg, regex_str, trigger, msg_reg, skip_match=Non
                 log.flush_info()
             wait_kicad_ready_i(cfg)
             return
+        # KiCad is working, the phase can take longer than expected (i.e. a big DRC)
+        if cfg.phase is not None:
+            cfg.phase.extend()
+        if not cfg.verbose:
+            continue
         # Check if this message contains progress information
-        if cfg.verbose and res.startswith('PANGO:'):
-            res = res[6:]
-            match = regex.match(res)
-            if match is not None:
-                m = match.group(1)
-                if skip_match is None or m != skip_match:
-                    m = msg_reg+': '+m+padding
-                    log.info_progress(m[:80])
-                    with_info = True
+        if res.startswith(PROGRESS_MSG):
+            pct = progress_percent(res)
+        elif res.startswith('PANGO:'):
+            match = regex.match(res[6:])
+            if match is None or (skip_match is not None and match.group(1) == skip_match):
+                continue
+            m = match.group(1)
+        log.info_progress((msg_reg+': '+', '.join(filter(None, (pct, m)))+padding)[:80])
+        with_info = True
 
 
 def wait_start_by_msg(cfg):
+    with phase(cfg, 'start'):
+        return _wait_start_by_msg(cfg)
+
+
+def _wait_start_by_msg(cfg):
     cfg.logger.info('Waiting for PCB new window ...')
     pre = 'GTK:Window Title:'
     pre_l = len(pre)
     cfg.logger.debug('Waiting pcbnew to start and load the PCB')
-    # Inform the elapsed time for slow loads
-    pres = [pre, 'PANGO:0:']
+    # Inform the progress and the elapsed time for slow loads
+    pres = [pre, 'PANGO:0:', PROGRESS_MSG]
     elapsed_r = re.compile(r'PANGO:(\d:\d\d:\d\d)')
     if cfg.is_pcbnew:
         kind = 'PCB'
@@ -613,14 +1132,23 @@ def wait_start_by_msg(cfg):
     loading_msg = 'Loading '+kind
     prg_msg = prg_name+' —'
     with_elapsed = False
+    elapsed = pct = None
     while True:
         # Wait for any window
         res = wait_queue(cfg, pres, starts=True, timeout=cfg.wait_start, with_windows=True)
         cfg.logger.debug('wait_pcbew_start_by_msg got '+res)
+        if res.startswith(PROGRESS_MSG):
+            # Progress bar of the load dialog
+            if res.startswith(PROGRESS_MSG+loading_msg+' '):
+                pct = progress_percent(res)
+                log.info_progress(loading_msg+': '+', '.join(filter(None, (pct, elapsed))))
+                with_elapsed = True
+            continue
         match = elapsed_r.match(res)
         title = res[pre_l:]
         if not match and with_elapsed:
             log.flush_info()
+            with_elapsed = False
         if not cfg.ki5 and title.endswith(cfg.window_title_end):
             # KiCad 6
             if title.startswith('[no schematic loaded]'):
@@ -651,7 +1179,8 @@ def wait_start_by_msg(cfg):
         elif match is not None:
             msg = match.group(1)
             if msg != '0:00:00':
-                log.info_progress('Elapsed time: '+msg)
+                elapsed = 'elapsed time: '+msg
+                log.info_progress(loading_msg+': '+pct+', '+elapsed if pct else 'Elapsed time: '+msg)
                 with_elapsed = True
         elif title == 'Error':
             dismiss_error(cfg, title)
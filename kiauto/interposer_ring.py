@@ -0,0 +1,171 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Shared memory ring used to receive the interposer events.
+This is an alternative to the text lines sent using stdout, the interposer doesn't need to lock stdio and flush for
+each event.
+The layout and the event kinds must match the ones in interposer/interposer.c
+"""
+import mmap
+import os
+import struct
+import tempfile
+import time
+
+RING_MAGIC = 0x4B495247
+RING_VERSION = 1
+HEADER_SIZE = 64
+HEADER_FMT = '<IIIIII'
+HEAD_OFFSET = 24
+STR_HEAD_OFFSET = 32
+RECORD_FMT = '<QQQiIHHI'
+RECORD_SIZE = struct.calcsize(RECORD_FMT)
+DEFAULT_RECORDS = 1 << 16
+DEFAULT_STR_SIZE = 1 << 20
+# Time between checks when the ring is empty
+POLL_DELAY = 0.005
+# An event that stays incomplete for this time is discarded (i.e. the process was killed while writing it)
+STALL_TIME = 0.5
+# How the text and the argument are added to the prefix
+EVF_NONE, EVF_STR, EVF_INT, EVF_STR_INT, EVF_HEX = range(5)
+# Indexed by the event kind
+EVENTS = (('* ', EVF_STR),
+          ('GLX:Swap ', EVF_STR),
+          ('PANGO:', EVF_STR),
+          ('GTK:Window Title:', EVF_STR),
+          ('GTK:Window Set Modal:', EVF_STR_INT),
+          ('GTK:Window Show:', EVF_STR),
+          ('GTK:Button Label:', EVF_STR),
+          ('GTK:Button Label:**Changed from ', EVF_STR),
+          ('GTK:Error:', EVF_STR),
+          ('GTK:Read:', EVF_STR),
+          ('GTK:Print Run:', EVF_STR),
+          ('GTK:Label Set Text 2:', EVF_STR),
+          ('GTK:Filename:', EVF_STR),
+          ('GTK:Filename:**Changed from ', EVF_STR),
+          ('IO:open:', EVF_STR),
+          ('IO:fopen64:', EVF_STR),
+          ('IO:fopen:', EVF_STR),
+          ('IO:open64:', EVF_HEX),
+          ('IO:open:', EVF_HEX),
+          ('IO:close:', EVF_STR),
+          ('GTK:Main:In', EVF_NONE),
+          ('GTK:Main:Out', EVF_NONE),
+          ('GTK:Window Destroy:', EVF_STR),
+          ('IO:openat:', EVF_HEX),
+          ('IO:openat64:', EVF_HEX),
+          ('GTK:Main:Idle', EVF_NONE),
+          ('GTK:Main:Busy', EVF_NONE),
+          ('GLX:Settled ', EVF_INT),
+          ('GTK:Dialog Auto:', EVF_STR),
+          ('IO:Complete:', EVF_STR_INT),
+          ('GLX:Captured:', EVF_STR_INT),
+          ('GTK:Progress:', EVF_STR_INT),
+          ('GTK:Progress End:', EVF_STR))
+
+
+def format_event(kind, text, arg):
+    """ Converts an event into the same line the interposer prints to stdout """
+    if kind >= len(EVENTS):
+        return '* Unknown interposer event {}\n'.format(kind)
+    prefix, fmt = EVENTS[kind]
+    if fmt == EVF_STR:
+        return prefix+text+'\n'
+    if fmt == EVF_INT:
+        return prefix+str(arg)+'\n'
+    if fmt == EVF_STR_INT:
+        return prefix+text+' '+str(arg)+'\n'
+    if fmt == EVF_HEX:
+        return prefix+'0x{:X}\n'.format(arg & 0xFFFFFFFF)
+    return prefix+'\n'
+
+
+class InterposerRing(object):
+    def __init__(self, logger, records=DEFAULT_RECORDS, str_size=DEFAULT_STR_SIZE):
+        # Use RAM if available
+        fd, self.name = tempfile.mkstemp(prefix='kiauto_ring_', dir='/dev/shm' if os.path.isdir('/dev/shm') else None)
+        size = HEADER_SIZE+records*RECORD_SIZE+str_size
+        try:
+            os.ftruncate(fd, size)
+            self.mm = mmap.mmap(fd, size)
+        finally:
+            os.close(fd)
+        struct.pack_into(HEADER_FMT, self.mm, 0, RING_MAGIC, RING_VERSION, RECORD_SIZE, records, str_size, 0)
+        self.rec_mask = records-1
+        self.str_size = str_size
+        self.str_mask = str_size-1
+        self.str_offset = HEADER_SIZE+records*RECORD_SIZE
+        self.tail = 0
+        self.stalled = None
+        self.tm_start = time.monotonic_ns()
+        # Chrome/Perfetto trace, see kiauto/trace.py
+        self.trace = None
+        logger.debug('Using interposer ring {} ({} events)'.format(self.name, records))
+
+    def get_text(self, pos, length, str_head):
+        if str_head-pos > self.str_size:
+            # Overwritten by newer texts
+            return '?'
+        start = self.str_offset+(pos & self.str_mask)
+        # Avoid crashes when KiCad 5 sends an invalid Unicode sequence
+        return self.mm[start:start+length].decode(errors='ignore')
+
+    def read(self):
+        """ Returns a list with the events available, as (time, line) tuples """
+        res = []
+        head = struct.unpack_from('<Q', self.mm, HEAD_OFFSET)[0]
+        while self.tail < head:
+            offset = HEADER_SIZE+(self.tail & self.rec_mask)*RECORD_SIZE
+            seq, ts, pos, arg, tid, kind, length, _ = struct.unpack_from(RECORD_FMT, self.mm, offset)
+            if seq <= self.tail:
+                # Still being written
+                now = time.monotonic()
+                if self.stalled is None:
+                    self.stalled = now
+                elif now-self.stalled > STALL_TIME:
+                    res.append(((ts-self.tm_start)/1e9, '* Interposer ring incomplete event discarded\n'))
+                    self.stalled = None
+                    self.tail += 1
+                    continue
+                break
+            self.stalled = None
+            if seq > self.tail+1:
+                # The interposer wrapped around, skip the lost events
+                lost = seq-1-self.tail
+                res.append(((ts-self.tm_start)/1e9, '* Interposer ring overrun, {} events lost\n'.format(lost)))
+                self.tail = seq-1
+                continue
+            line = format_event(kind, self.get_text(pos, length, struct.unpack_from('<Q', self.mm, STR_HEAD_OFFSET)[0]),
+                                arg)
+            if struct.unpack_from('<Q', self.mm, offset)[0] != seq:
+                # Overwritten while we were reading it
+                continue
+            res.append(((ts-self.tm_start)/1e9, line))
+            if self.trace is not None:
+                self.trace.interposer_event(ts, tid, line[:-1])
+            self.tail += 1
+        return res
+
+    def close(self):
+        # The mapping is released at exit, the reader thread could be still using it
+        try:
+            os.remove(self.name)
+        except OSError:
+            pass
+
+
+def enqueue_ring(ring, popen_obj, queue):
+    """ Move the events from the ring to the queue.
+        We finish when the process is dead and the ring is empty """
+    while True:
+        finished = popen_obj.poll() is not None
+        events = ring.read()
+        for ev in events:
+            queue.put(ev)
+        if not events:
+            if finished:
+                break
+            time.sleep(POLL_DELAY)
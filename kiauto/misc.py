@@ -64,23 +64,7 @@ class Config(object):
         self.export_format = 'pdf'
         self.is_pcbnew = is_pcbnew
         if input_file:
-            self.input_file = input_file
-            self.input_no_ext = os.path.splitext(input_file)[0]
-            #
-            # As soon as we init pcbnew the following files are modified:
-            #
-            if os.path.isfile(self.input_no_ext+'.pro'):
-                self.start_pro_stat = os.stat(self.input_no_ext+'.pro')
-            else:
-                self.start_pro_stat = None
-            if os.path.isfile(self.input_no_ext+'.kicad_pro'):
-                self.start_kicad_pro_stat = os.stat(self.input_no_ext+'.kicad_pro')
-            else:
-                self.start_kicad_pro_stat = None
-            if os.path.isfile(self.input_no_ext+'.kicad_prl'):
-                self.start_kicad_prl_stat = os.stat(self.input_no_ext+'.kicad_prl')
-            else:
-                self.start_kicad_prl_stat = None
+            self.set_input_file(input_file)
         if args:
             # Session debug
             self.use_wm = args.use_wm  # Use a Window Manager, dialogs behaves in a different way
@@ -107,6 +91,8 @@ class Config(object):
         self.colordepth = 24
         self.video_name = None
         self.video_dir = self.output_dir = ''
+        # Persistent KiCad process (worker mode)
+        self.worker = False
         # Executable and dirs
         self.eeschema = 'eeschema'
         self.pcbnew = 'pcbnew'
@@ -179,6 +165,36 @@ class Config(object):
                 logger.debug('Redirecting KiCad config path to: '+self.kicad_conf_path)
         else:
             logger.warning('Missing KiCad main config file '+self.conf_kicad)
+        self.set_conf_names()
+        self.sys_sym_lib_table = [KICAD_SHARE+'template/sym-lib-table']
+        self.sys_fp_lib_table = [KICAD_SHARE+'template/fp-lib-table']
+        if ng_ver:
+            # 20200912: sym-lib-table is missing
+            self.sys_sym_lib_table.insert(0, KICAD_NIGHTLY_SHARE+'template/sym-lib-table')
+            self.sys_fp_lib_table.insert(0, KICAD_NIGHTLY_SHARE+'template/fp-lib-table')
+        # Some details about the UI
+        if not self.ki5:
+            # KiCad 5.99.0
+            # self.ee_window_title = r'\[.*\] — Eeschema$'  # "PROJECT [HIERARCHY_PATH] - Eeschema"
+            # KiCad 6.0.0 rc1
+            self.ee_window_title = r'\[.*\] — Schematic Editor$'  # "PROJECT [HIERARCHY_PATH] - Schematic Editor"
+            self.pn_window_title = r'.* — PCB Editor$'  # "PROJECT - PCB Editor"
+            self.pn_simple_window_title = 'PCB Editor'
+            kind = 'PCB' if self.is_pcbnew else 'Schematic'
+            self.window_title_end = ' — '+kind+' Editor'
+        else:
+            # KiCad 5.1.6
+            self.ee_window_title = r'Eeschema.*\.sch'  # "Eeschema - file.sch"
+            self.pn_window_title = r'^Pcbnew'
+            self.pn_simple_window_title = 'Pcbnew'
+        # Collected errors and unconnecteds (warnings)
+        self.errs = []
+        self.wrns = []
+        # Error filters
+        self.err_filters = []
+
+    def set_conf_names(self):
+        """ Names for the config files in kicad_conf_path (after solving kicad_common) """
         # - eeschema config
         self.conf_eeschema = os.path.join(self.kicad_conf_path, 'eeschema')
         self.conf_eeschema_bkp = None
@@ -211,32 +227,31 @@ class Config(object):
         # - sym-lib-table
         self.user_sym_lib_table = os.path.join(self.kicad_conf_path, 'sym-lib-table')
         self.user_fp_lib_table = os.path.join(self.kicad_conf_path, 'fp-lib-table')
-        self.sys_sym_lib_table = [KICAD_SHARE+'template/sym-lib-table']
-        self.sys_fp_lib_table = [KICAD_SHARE+'template/fp-lib-table']
-        if ng_ver:
-            # 20200912: sym-lib-table is missing
-            self.sys_sym_lib_table.insert(0, KICAD_NIGHTLY_SHARE+'template/sym-lib-table')
-            self.sys_fp_lib_table.insert(0, KICAD_NIGHTLY_SHARE+'template/fp-lib-table')
-        # Some details about the UI
-        if not self.ki5:
-            # KiCad 5.99.0
-            # self.ee_window_title = r'\[.*\] — Eeschema$'  # "PROJECT [HIERARCHY_PATH] - Eeschema"
-            # KiCad 6.0.0 rc1
-            self.ee_window_title = r'\[.*\] — Schematic Editor$'  # "PROJECT [HIERARCHY_PATH] - Schematic Editor"
-            self.pn_window_title = r'.* — PCB Editor$'  # "PROJECT - PCB Editor"
-            self.pn_simple_window_title = 'PCB Editor'
-            kind = 'PCB' if self.is_pcbnew else 'Schematic'
-            self.window_title_end = ' — '+kind+' Editor'
+
+    def set_conf_path(self, path):
+        """ Use the configuration in path (i.e. a private copy) """
+        self.kicad_conf_path = path
+        self.conf_kicad = os.path.join(path, 'kicad_common.json' if self.conf_kicad_json else 'kicad_common')
+        self.set_conf_names()
+
+    def set_input_file(self, input_file):
+        self.input_file = input_file
+        self.input_no_ext = os.path.splitext(input_file)[0]
+        #
+        # As soon as we init pcbnew the following files are modified:
+        #
+        if os.path.isfile(self.input_no_ext+'.pro'):
+            self.start_pro_stat = os.stat(self.input_no_ext+'.pro')
         else:
-            # KiCad 5.1.6
-            self.ee_window_title = r'Eeschema.*\.sch'  # "Eeschema - file.sch"
-            self.pn_window_title = r'^Pcbnew'
-            self.pn_simple_window_title = 'Pcbnew'
-        # Collected errors and unconnecteds (warnings)
-        self.errs = []
-        self.wrns = []
-        # Error filters
-        self.err_filters = []
+            self.start_pro_stat = None
+        if os.path.isfile(self.input_no_ext+'.kicad_pro'):
+            self.start_kicad_pro_stat = os.stat(self.input_no_ext+'.kicad_pro')
+        else:
+            self.start_kicad_pro_stat = None
+        if os.path.isfile(self.input_no_ext+'.kicad_prl'):
+            self.start_kicad_prl_stat = os.stat(self.input_no_ext+'.kicad_prl')
+        else:
+            self.start_kicad_prl_stat = None
 
     def load_kicad_environment(self, logger):
         self.env = {}
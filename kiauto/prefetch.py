@@ -0,0 +1,130 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Background prefetch of the 3D models used by a PCB.
+KiCad loads the models one by one from the GUI thread. When the libraries are on a slow (i.e. network) file system
+most of the time is spent waiting for them. Here we read them in parallel while KiCad is starting, so they are in the
+page cache when KiCad asks for them.
+"""
+import os
+import re
+from queue import Queue
+from threading import Thread, Lock
+import time
+
+MODEL_RE = re.compile(r'\(model\s+(?:"((?:[^"\\]|\\.)*)"|([^\s()]+))')
+VAR_RE = re.compile(r'\$\{([^}]+)\}|\$\(([^)]+)\)')
+# KiCad tries these when the model isn't there or when it needs a STEP (kicad2step)
+ALT_EXTS = ('.wrl', '.step', '.stp')
+# Defaults for the system models, used when the variables aren't defined
+DEFAULT_DIRS = {'KICAD6_3DMODEL_DIR': '/usr/share/kicad/3dmodels', 'KISYS3DMOD': '/usr/share/kicad/modules/packages3d'}
+WORKERS = 8
+CHUNK = 1 << 20
+
+
+def model_paths(pcb, env):
+    """ The 3D model files referenced by the PCB, with the variables expanded """
+    with open(pcb, 'rt', encoding='utf-8', errors='replace') as f:
+        content = f.read()
+    vars = dict(DEFAULT_DIRS)
+    vars.update(os.environ)
+    vars.update(env)
+    vars['KIPRJMOD'] = os.path.dirname(os.path.abspath(pcb))
+
+    def expand(m):
+        name = m.group(1) or m.group(2)
+        return vars.get(name, m.group(0))
+
+    files = []
+    seen = set()
+    for m in MODEL_RE.finditer(content):
+        name = m.group(1).replace('\\"', '"') if m.group(1) is not None else m.group(2)
+        name = VAR_RE.sub(expand, name)
+        if not os.path.isabs(name):
+            name = os.path.join(vars['KIPRJMOD'], name)
+        base, ext = os.path.splitext(name)
+        for fname in [name]+[base+e for e in ALT_EXTS if e != ext.lower()]:
+            if fname not in seen:
+                seen.add(fname)
+                files.append(fname)
+    return files
+
+
+class ModelPrefetch(object):
+    def __init__(self, pcb, env, logger, workers=WORKERS):
+        self.pcb = pcb
+        self.env = env
+        self.logger = logger
+        self.workers = workers
+        self.queue = Queue()
+        self.lock = Lock()
+        self.files = 0
+        self.bytes = 0
+        self.pending = 0
+        self.start_time = 0
+
+    def start(self):
+        """ Starts the prefetch, the threads are daemons, we don't wait for them """
+        self.start_time = time.monotonic()
+        Thread(target=self.scan, name='kiauto_prefetch', daemon=True).start()
+        return self
+
+    def scan(self):
+        try:
+            files = model_paths(self.pcb, self.env)
+        except OSError as e:
+            self.logger.debug('Prefetch: unable to read the PCB: {}'.format(e))
+            return
+        if not files:
+            return
+        self.pending = len(files)
+        for fname in files:
+            self.queue.put(fname)
+        for _ in range(min(self.workers, len(files))):
+            Thread(target=self.worker, name='kiauto_prefetch_w', daemon=True).start()
+
+    def warm(self, fname):
+        """ Reads the file, returns the size """
+        try:
+            fd = os.open(fname, os.O_RDONLY)
+        except OSError:
+            # Most alternative names doesn't exist
+            return -1
+        size = 0
+        try:
+            if hasattr(os, 'posix_fadvise'):
+                os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_WILLNEED)
+            # The advice is just a hint (and NFS may ignore it), read the data
+            while True:
+                data = os.read(fd, CHUNK)
+                if not data:
+                    break
+                size += len(data)
+        except OSError:
+            pass
+        finally:
+            os.close(fd)
+        return size
+
+    def worker(self):
+        while True:
+            fname = self.queue.get()
+            if fname is None:
+                return
+            size = self.warm(fname)
+            with self.lock:
+                if size >= 0:
+                    self.files += 1
+                    self.bytes += size
+                self.pending -= 1
+                done = self.pending == 0
+            if done:
+                self.logger.debug('Prefetched {} 3D models ({} KiB) in {:.2f} s'.format(self.files, self.bytes//1024,
+                                  time.monotonic()-self.start_time))
+                # Unblock the rest of the workers
+                for _ in range(self.workers):
+                    self.queue.put(None)
+                return
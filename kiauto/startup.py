@@ -0,0 +1,131 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+KiCad start-up profile.
+The interposer records the libraries loaded using dlopen, the files opened (per directory) and the window titles
+and shown windows from the moment it's loaded to the first time KiCad enters the main loop (see "Start-up profile"
+in interposer.c). Here we make a report: the time of each phase (between the window events), how much of it was
+spent loading libraries and opening files, and the slowest libraries and directories.
+"""
+import os
+
+# Entries shown for the libraries and directories
+TOP = 15
+
+
+class StartupProfile(object):
+    def __init__(self):
+        self.start = self.end = 0
+        self.end_kind = 'exit'
+        self.marks = []
+        self.dlopens = []
+        self.dirs = []
+
+    @staticmethod
+    def load(fname):
+        p = StartupProfile()
+        with open(fname, 'rt', errors='replace') as f:
+            for ln in f:
+                kind, _, data = ln.rstrip('\n').partition(' ')
+                if kind == 'start':
+                    p.start = int(data)
+                elif kind == 'end':
+                    ts, p.end_kind = data.split(' ', 1)
+                    p.end = int(ts)
+                elif kind == 'mark':
+                    ts, text = data.split(' ', 1)
+                    p.marks.append((int(ts), text))
+                elif kind == 'dlopen':
+                    ts, dur, depth, ok, name = data.split(' ', 4)
+                    p.dlopens.append((int(ts), int(dur), int(depth), ok == '1', name))
+                elif kind == 'dir':
+                    opens, misses, dur, first, last, phase, path = data.split(' ', 6)
+                    p.dirs.append((int(opens), int(misses), int(dur), int(first), int(last), int(phase), path))
+        return p
+
+    def phases(self, launch):
+        """ Name, start and end of each phase, in ns """
+        phases = []
+        if launch and launch < self.start:
+            phases.append(('Process start (exec and shared libraries)', launch, self.start))
+        last_ts, last_name = self.start, 'Interposer loaded'
+        for ts, text in self.marks:
+            phases.append((last_name+' -> '+text, last_ts, ts))
+            last_ts, last_name = ts, text
+        phases.append((last_name+' -> '+('Main loop' if self.end_kind == 'main' else 'KiCad exit'), last_ts, self.end))
+        return phases
+
+    def report(self, launch=None, top=TOP):
+        """ The report as a list of lines, launch is when we started KiCad (ns) """
+        ms = 1e-6
+        origin = launch if launch and launch < self.start else self.start
+        total = (self.end-origin)*ms
+        lines = ['KiCad start-up: {:.1f} ms {}'.format(total, 'to the main loop' if self.end_kind == 'main' else
+                                                       'to the exit, the main loop was never reached'), '']
+        # Phases, in order. The time in dlopen is from the outer calls, the inner are included.
+        lines.append('Phases (libraries loaded and files opened during each one)')
+        lines.append('{:>9} {:>6} {:>10} {:>9} {:>6} {:>9}  {}'.format('ms', '%', 'dlopen ms', 'files ms', 'files',
+                                                                     'other ms', 'phase'))
+        first_phase = 1 if launch and launch < self.start else 0
+        for n, (name, start, end) in enumerate(self.phases(launch)):
+            dur = end-start
+            pct = dur*ms*100/total if total else 0
+            if n < first_phase:
+                # Before the interposer, nothing measured
+                lines.append('{:9.1f} {:6.1f} {:>10} {:>9} {:>6} {:>9}  {}'.format(dur*ms, pct, '-', '-', '-', '-', name))
+                continue
+            dl = sum(d[1] for d in self.dlopens if d[2] == 0 and start <= d[0] < end)
+            files = [d for d in self.dirs if d[5] == n-first_phase]
+            io = sum(d[2] for d in files)
+            lines.append('{:9.1f} {:6.1f} {:10.1f} {:9.1f} {:6} {:9.1f}  {}'.format(dur*ms, pct, dl*ms, io*ms,
+                         sum(d[0] for d in files), max(dur-dl-io, 0)*ms, name))
+        # Slowest libraries
+        lines.append('')
+        lines.append('Slowest libraries ({} loaded, dlopen time includes the libraries they need and their constructors)'.
+                     format(len(self.dlopens)))
+        lines.append('{:>9} {:>9}  {}'.format('ms', 'at ms', 'library'))
+        for ts, dur, depth, ok, name in sorted(self.dlopens, key=lambda d: -d[1])[:top]:
+            lines.append('{:9.1f} {:9.1f}  {}{}{}'.format(dur*ms, (ts-origin)*ms, '  '*depth, name,
+                                                          '' if ok else ' (failed)'))
+        # Slowest directories, all the phases
+        dirs = {}
+        for opens, misses, dur, first, last, _, path in self.dirs:
+            d = dirs.get(path)
+            if d is None:
+                dirs[path] = [opens, misses, dur, first, last]
+            else:
+                d[0] += opens
+                d[1] += misses
+                d[2] += dur
+                d[3] = min(d[3], first)
+                d[4] = max(d[4], last)
+        lines.append('')
+        lines.append('Slowest directories ({} files opened in {}, time spent opening them)'.
+                     format(sum(d[0] for d in dirs.values()), len(dirs)))
+        lines.append('{:>9} {:>6} {:>8} {:>9} {:>9}  {}'.format('ms', 'files', 'missing', 'first ms', 'last ms',
+                                                                 'directory'))
+        for path, (opens, misses, dur, first, last) in sorted(dirs.items(), key=lambda d: -d[1][2])[:top]:
+            lines.append('{:9.1f} {:6} {:8} {:9.1f} {:9.1f}  {}'.format(dur*ms, opens, misses, (first-origin)*ms,
+                                                                       (last-origin)*ms, path))
+        return lines
+
+
+def write_startup_profile(cfg):
+    """ Makes the report from the interposer data, if available """
+    raw = getattr(cfg, 'startup_raw', None)
+    if not raw or not os.path.isfile(raw):
+        return
+    try:
+        lines = StartupProfile.load(raw).report(getattr(cfg, 'kicad_launch_ns', None))
+    except (OSError, ValueError) as e:
+        cfg.logger.warning('Malformed start-up profile {}: {}'.format(raw, e))
+        return
+    finally:
+        # The next run of KiCad (i.e. retries) will create a new one
+        os.remove(raw)
+    with open(cfg.startup_profile, 'wt') as f:
+        f.write('\n'.join(lines)+'\n')
+    cfg.logger.debug(lines[0]+', start-up profile stored in '+cfg.startup_profile)
@@ -0,0 +1,123 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Phase durations of previous runs, used to compute the timeouts.
+The interposer waits use a fixed timeout (300 s), so a hung KiCad takes 5 minutes to be detected, and slow boards can
+time out. Here we keep the last durations of each phase (start-up, dialogs, zone fill, DRC, file creation, etc.)
+for each command and input size (powers of 2). The phase timeout is computed from the observed percentile.
+Progress reported by KiCad (i.e. during the DRC) restarts the phase deadline, so only a stalled phase times out.
+Stored as JSON ($XDG_CACHE_HOME/kiauto/timings.json by default), shared by all the jobs using a lock.
+"""
+import fcntl
+import json
+import math
+import os
+import time
+
+# Samples kept for each phase
+KEEP = 50
+# Samples needed before using them
+MIN_SAMPLES = 5
+PERCENTILE = 0.95
+# timeout = percentile*FACTOR+SLACK, limited to [MIN_TIMEOUT, MAX_FACTOR*default]
+FACTOR = 3
+SLACK = 5
+MIN_TIMEOUT = 10
+MAX_FACTOR = 4
+
+
+def default_file():
+    cache = os.environ.get('XDG_CACHE_HOME') or os.path.join(os.path.expanduser('~'), '.cache')
+    return os.path.join(cache, 'kiauto', 'timings.json')
+
+
+def percentile(samples, p):
+    s = sorted(samples)
+    return s[max(math.ceil(p*len(s))-1, 0)]
+
+
+class Phase(object):
+    """ A step of the run and its deadline. A nested phase can't go beyond the deadline of the outer one. """
+    def __init__(self, name, limit, outer=None, now=None):
+        self.name = name
+        self.limit = limit
+        self.outer = outer
+        self.end = None
+        self.extend(now, propagate=False)
+
+    def extend(self, now=None, propagate=True):
+        """ KiCad is making progress, the deadline starts again from now """
+        if now is None:
+            now = time.time()
+        if propagate and self.outer is not None:
+            self.outer.extend(now)
+        end = now+self.limit
+        if self.outer is not None:
+            end = min(end, self.outer.end)
+        self.end = end if self.end is None else max(self.end, end)
+
+    def limiting(self):
+        """ The phase that sets our deadline """
+        ph = self
+        while ph.outer is not None and ph.outer.end <= ph.end:
+            ph = ph.outer
+        return ph
+
+
+class Timings(object):
+    def __init__(self, fname, logger):
+        self.fname = fname
+        self.logger = logger
+        self.phases = self.load()
+        # Samples from this run, merged on save
+        self.new = {}
+        self.key = ''
+
+    def load(self):
+        try:
+            with open(self.fname, 'rt') as f:
+                return json.load(f).get('phases', {})
+        except (OSError, ValueError, AttributeError):
+            return {}
+
+    def set_job(self, command, input_file):
+        """ The samples are used for the same command and a similar input size """
+        try:
+            size = os.path.getsize(input_file)
+        except OSError:
+            size = 0
+        self.key = '{}|{}|'.format(command, size.bit_length())
+
+    def timeout(self, phase, default):
+        """ Timeout for a phase, default if we don't have enough samples """
+        samples = self.phases.get(self.key+phase, [])+self.new.get(self.key+phase, [])
+        if len(samples) < MIN_SAMPLES:
+            return default
+        return min(max(percentile(samples, PERCENTILE)*FACTOR+SLACK, MIN_TIMEOUT), default*MAX_FACTOR)
+
+    def add(self, phase, duration):
+        self.new.setdefault(self.key+phase, []).append(round(duration, 3))
+
+    def save(self):
+        if not self.new:
+            return
+        try:
+            os.makedirs(os.path.dirname(self.fname), exist_ok=True)
+            with open(self.fname+'.lock', 'w') as lock:
+                # Other jobs could be saving
+                fcntl.flock(lock, fcntl.LOCK_EX)
+                phases = self.load()
+                for k, v in self.new.items():
+                    phases[k] = (phases.get(k, [])+v)[-KEEP:]
+                tmp = self.fname+'.{}'.format(os.getpid())
+                with open(tmp, 'wt') as f:
+                    json.dump({'phases': phases}, f)
+                os.replace(tmp, self.fname)
+        except OSError as e:
+            self.logger.warning('Unable to store the phase timings in {}: {}'.format(self.fname, e))
+            return
+        self.logger.debug('Stored {} phase timings in {}'.format(sum(len(v) for v in self.new.values()), self.fname))
+        self.new = {}
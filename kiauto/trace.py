@@ -0,0 +1,97 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Chrome/Perfetto JSON trace of a run (open it using chrome://tracing or https://ui.perfetto.dev/)
+The interposer events are time stamped by the interposer (CLOCK_MONOTONIC), the same clock used by time.monotonic_ns,
+so the KiCad events and our waits are aligned.
+"""
+from functools import wraps
+import json
+import os
+import re
+import threading
+import time
+
+# Thread id shown by the tools, not available before 3.8
+get_tid = getattr(threading, 'get_native_id', threading.get_ident)
+SWAP_RE = re.compile(r'GLX:Swap (\d+) (\d+) (\d+)')
+# Events that mark the start and the end of a span in the KiCad main thread
+SPAN_START = {'GTK:Main:Busy': 'Busy', 'GTK:Main:In': 'Main loop'}
+SPAN_END = {'GTK:Main:Idle': 'Busy', 'GTK:Main:Out': 'Main loop'}
+
+
+class Trace(object):
+    def __init__(self, fname, logger):
+        self.fname = fname
+        self.logger = logger
+        self.pid = os.getpid()
+        self.kicad_pid = 0
+        self.events = [{'ph': 'M', 'name': 'process_name', 'pid': self.pid, 'args': {'name': 'KiAuto'}}]
+        self.open_spans = {}
+
+    def set_kicad_pid(self, pid, name):
+        self.kicad_pid = pid
+        self.events.append({'ph': 'M', 'name': 'process_name', 'pid': pid, 'args': {'name': name}})
+
+    def interposer_event(self, ts, tid, line):
+        """ An event from the interposer, ts in ns """
+        ts /= 1000
+        cat = line.split(':', 1)[0]
+        if line.startswith('GLX:Swap'):
+            m = SWAP_RE.match(line)
+            if m:
+                self.events.append({'ph': 'X', 'name': 'Swap', 'cat': cat, 'ts': int(m.group(2)), 'dur': int(m.group(3)),
+                                    'pid': self.kicad_pid, 'tid': tid, 'args': {'frame': int(m.group(1))}})
+                return
+        name = SPAN_START.get(line)
+        if name is not None:
+            # Nested main loops (modal dialogs) are recorded as nested spans
+            self.events.append({'ph': 'B', 'name': name, 'cat': cat, 'ts': ts, 'pid': self.kicad_pid, 'tid': tid})
+            self.open_spans[(tid, name)] = self.open_spans.get((tid, name), 0)+1
+            return
+        name = SPAN_END.get(line)
+        if name is not None:
+            if self.open_spans.get((tid, name)):
+                self.open_spans[(tid, name)] -= 1
+                self.events.append({'ph': 'E', 'name': name, 'cat': cat, 'ts': ts, 'pid': self.kicad_pid, 'tid': tid})
+            return
+        self.events.append({'ph': 'i', 's': 't', 'name': line[:80], 'cat': cat, 'ts': ts, 'pid': self.kicad_pid,
+                            'tid': tid, 'args': {'line': line}})
+
+    def span(self, name, start, args=None):
+        """ A span of our code, start in ns """
+        now = time.monotonic_ns()
+        ev = {'ph': 'X', 'name': name, 'cat': 'kiauto', 'ts': start/1000, 'dur': (now-start)/1000, 'pid': self.pid,
+              'tid': get_tid()}
+        if args:
+            ev['args'] = args
+        self.events.append(ev)
+
+    def write(self):
+        # Close the spans that are still open, KiCad was killed
+        now = time.monotonic_ns()/1000
+        for (tid, name), n in self.open_spans.items():
+            for _ in range(n):
+                self.events.append({'ph': 'E', 'name': name, 'ts': now, 'pid': self.kicad_pid, 'tid': tid})
+        self.open_spans = {}
+        with open(self.fname, 'wt') as f:
+            json.dump({'traceEvents': self.events, 'displayTimeUnit': 'ms'}, f)
+        self.logger.debug('Trace stored in {} ({} events)'.format(self.fname, len(self.events)))
+
+
+def traced(func):
+    """ Adds a span for each call of a function that takes cfg as first argument """
+    @wraps(func)
+    def wrapper(cfg, *args, **kwargs):
+        trace = getattr(cfg, 'trace', None)
+        if trace is None:
+            return func(cfg, *args, **kwargs)
+        start = time.monotonic_ns()
+        try:
+            return func(cfg, *args, **kwargs)
+        finally:
+            trace.span(func.__name__, start, {'what': str(args[0])} if args else None)
+    return wrapper
@@ -27,6 +27,7 @@ from tempfile import mkdtemp
 import time
 # python3-xvfbwrapper
 from xvfbwrapper import Xvfb
+from kiauto.display_pool import DisplayLease, DisplayPoolError
 from kiauto.file_util import get_log_files
 from kiauto.misc import KICAD_VERSION_5_99, MISSING_TOOL, KICAD_DIED, __version__
 import kiauto.misc
@@ -44,6 +45,11 @@ def set_time_out_scale(scale):
 
 class PopenContext(Popen):
 
+    def __init__(self, *args, **kwargs):
+        # CLOCK_MONOTONIC, like the interposer time stamps
+        self.start_ns = time.monotonic_ns()
+        super().__init__(*args, **kwargs)
+
     def __exit__(self, type, value, traceback):
         logger.debug("Closing pipe with %d", self.pid)
         # Note: currently we don't communicate with the child so these cases are never used.
@@ -197,16 +203,31 @@ def start_x11vnc(do_it, old_display):
         yield
 
 
+def lease_display(cfg):
+    """ A display from the pool (KIAUTO_DISPLAY_POOL), already running, or None """
+    pool = os.environ.get('KIAUTO_DISPLAY_POOL')
+    if not pool:
+        return None
+    try:
+        return DisplayLease(pool, cfg.rec_width, cfg.rec_height, cfg.colordepth, cfg.use_wm, logger)
+    except DisplayPoolError as e:
+        logger.warning('Display pool not available ({}), starting an X server'.format(e))
+    return None
+
+
 @contextmanager
 def recorded_xvfb(cfg, num_try=0):
     old_display = os.environ.get('DISPLAY')
     if cfg.record and shutil.which('recordmydesktop') is None:
         logger.error('To record the session please install `recordmydesktop`')
         cfg.record = False
-    with Xvfb(width=cfg.rec_width, height=cfg.rec_height, colordepth=cfg.colordepth):
-        wait_xserver(cfg.output_dir, num_try)
+    lease = lease_display(cfg)
+    with lease or Xvfb(width=cfg.rec_width, height=cfg.rec_height, colordepth=cfg.colordepth):
+        if lease is None:
+            wait_xserver(cfg.output_dir, num_try)
         with start_x11vnc(cfg.start_x11vnc, old_display):
-            with start_wm(cfg.use_wm):
+            # The pool could have a WM running
+            with start_wm(cfg.use_wm and not (lease and lease.wm)):
                 with start_record(cfg.record, cfg.video_dir, cfg.video_name):
                     yield
 
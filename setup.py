@@ -17,7 +17,7 @@ setup(name='kiauto',
       url=__url__,
       # Packages are marked using __init__.py
       packages=find_packages(),
-      scripts=['src/eeschema_do', 'src/pcbnew_do', 'src/kicad2step_do'],
+      scripts=['src/eeschema_do', 'src/pcbnew_do', 'src/kicad2step_do', 'src/kiauto_batch', 'src/kiauto_display_pool'],
       install_requires=['xvfbwrapper', 'psutil'],
       include_package_data=True,
       classifiers=['Development Status :: 4 - Beta',
@@ -63,6 +63,22 @@ def test_erc_fail(test_dir):
     ctx.clean_up()
 
 
+@pytest.mark.skipif(os.environ.get('KIAUTO_INTERPOSER_DISABLE', '0') == '1', reason="Fail fast needs the interposer")
+def test_erc_fail_fast(test_dir):
+    """ Same as test_erc_fail, but Eeschema is stopped after the report """
+    prj = 'fail-project'
+    ctx = context.TestContextSCH(test_dir, 'ERC_Error_Fail_Fast', prj)
+    cmd = [PROG, '-v', 'run_erc', '-x']
+    ctx.run(cmd, 255)
+    ctx.expect_out_file(prj+'.erc')
+    m = ctx.search_err(OUT_ERR_REX)
+    assert m is not None
+    assert m.group(1) == '1'
+    # No clean exit
+    assert ctx.search_err(r'ERC failed, stopping KiCad') is not None
+    ctx.clean_up()
+
+
 def test_erc_warning_1(test_dir):
     prj = 'warning-project'
     ctx = context.TestContextSCH(test_dir, 'test_erc_warning_1', prj)
@@ -0,0 +1,146 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Tests for the interposer ring reader (kiauto/interposer_ring.py)
+
+We write the records the same way the interposer does, so KiCad isn't needed.
+
+For debug information use:
+pytest-3 --log-cli-level debug
+
+"""
+
+import logging
+import os
+import struct
+import sys
+import time
+# Look for the 'kiauto' module from where the script is running
+script_dir = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(os.path.dirname(script_dir)))
+from kiauto import interposer_ring
+from kiauto.interposer_ring import (InterposerRing, HEADER_SIZE, HEAD_OFFSET, STR_HEAD_OFFSET, RECORD_FMT, RECORD_SIZE,
+                                    RING_MAGIC, HEADER_FMT)
+
+# Event kinds, as in interposer.c
+EV_INFO = 0
+EV_WIN_TITLE = 3
+EV_IO_OPEN64 = 17
+EV_MAIN_IN = 20
+EV_IO_COMPLETE = 29
+
+
+class Writer(object):
+    """ Does what ring_put() does in the interposer """
+    def __init__(self, ring):
+        self.ring = ring
+        self.mm = ring.mm
+        self.n_recs = ring.rec_mask+1
+
+    def head(self):
+        return struct.unpack_from('<Q', self.mm, HEAD_OFFSET)[0]
+
+    def add_str(self, text):
+        data = text.encode()+b'\0'
+        pos = struct.unpack_from('<Q', self.mm, STR_HEAD_OFFSET)[0]
+        if (pos & self.ring.str_mask)+len(data) > self.ring.str_size:
+            # Never split at the end of the area
+            pos += self.ring.str_size-(pos & self.ring.str_mask)
+        start = self.ring.str_offset+(pos & self.ring.str_mask)
+        self.mm[start:start+len(data)] = data
+        struct.pack_into('<Q', self.mm, STR_HEAD_OFFSET, pos+len(data))
+        return pos
+
+    def put(self, kind, text=None, arg=0, complete=True):
+        idx = self.head()
+        pos = self.add_str(text) if text is not None else 0
+        length = len(text.encode()) if text is not None else 0
+        seq = idx+1 if complete else 0
+        offset = HEADER_SIZE+(idx & (self.n_recs-1))*RECORD_SIZE
+        struct.pack_into(RECORD_FMT, self.mm, offset, seq, time.monotonic_ns(), pos, arg, os.getpid(), kind, length, 0)
+        struct.pack_into('<Q', self.mm, HEAD_OFFSET, idx+1)
+
+
+def lines(events):
+    return [ev[1] for ev in events]
+
+
+def new_ring(**kwargs):
+    return InterposerRing(logging.getLogger(), **kwargs)
+
+
+def test_ring_header():
+    ring = new_ring(records=16, str_size=1024)
+    try:
+        assert struct.unpack_from(HEADER_FMT, ring.mm, 0) == (RING_MAGIC, 1, RECORD_SIZE, 16, 1024, 0)
+    finally:
+        ring.close()
+    assert not os.path.isfile(ring.name)
+
+
+def test_ring_decode():
+    ring = new_ring(records=16, str_size=1024)
+    try:
+        w = Writer(ring)
+        w.put(EV_WIN_TITLE, 'Pcbnew')
+        w.put(EV_IO_COMPLETE, '/tmp/out.pdf', 1234)
+        w.put(EV_MAIN_IN)
+        w.put(EV_IO_OPEN64, arg=-1)
+        w.put(len(interposer_ring.EVENTS))
+        assert lines(ring.read()) == ['GTK:Window Title:Pcbnew\n',
+                                      'IO:Complete:/tmp/out.pdf 1234\n',
+                                      'GTK:Main:In\n',
+                                      'IO:open64:0xFFFFFFFF\n',
+                                      '* Unknown interposer event {}\n'.format(len(interposer_ring.EVENTS))]
+        # Nothing new
+        assert ring.read() == []
+        w.put(EV_INFO, 'More')
+        assert lines(ring.read()) == ['* More\n']
+    finally:
+        ring.close()
+
+
+def test_ring_overrun():
+    ring = new_ring(records=4, str_size=1024)
+    try:
+        w = Writer(ring)
+        for n in range(6):
+            w.put(EV_INFO, 'Event {}'.format(n))
+        # The reader resumes from the newest record found at its position
+        assert lines(ring.read()) == ['* Interposer ring overrun, 4 events lost\n', '* Event 4\n', '* Event 5\n']
+    finally:
+        ring.close()
+
+
+def test_ring_text_overwritten():
+    ring = new_ring(records=16, str_size=256)
+    try:
+        w = Writer(ring)
+        w.put(EV_WIN_TITLE, 'Old')
+        # Simulate a writer that moved the strings head more than a full turn
+        struct.pack_into('<Q', ring.mm, STR_HEAD_OFFSET, 1024)
+        assert lines(ring.read()) == ['GTK:Window Title:?\n']
+    finally:
+        ring.close()
+
+
+def test_ring_incomplete(monkeypatch):
+    monkeypatch.setattr(interposer_ring, 'STALL_TIME', 0.01)
+    ring = new_ring(records=16, str_size=1024)
+    try:
+        w = Writer(ring)
+        w.put(EV_INFO, 'Complete')
+        # The process died while writing it
+        w.put(EV_INFO, 'Incomplete', complete=False)
+        w.put(EV_INFO, 'After')
+        # We wait for it
+        assert lines(ring.read()) == ['* Complete\n']
+        assert ring.read() == []
+        time.sleep(0.05)
+        # Now is discarded
+        assert lines(ring.read()) == ['* Interposer ring incomplete event discarded\n', '* After\n']
+    finally:
+        ring.close()
@@ -0,0 +1,129 @@
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Tests for the phase timeouts (kiauto/timings.py)
+
+KiCad isn't needed.
+
+For debug information use:
+pytest-3 --log-cli-level debug
+
+"""
+
+import logging
+import os
+import sys
+# Look for the 'kiauto' module from where the script is running
+script_dir = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(os.path.dirname(script_dir)))
+from kiauto import timings
+from kiauto.timings import Phase, Timings, percentile
+
+
+def new_timings(tmp_path, command='pcbnew run_drc', size=1000):
+    pcb = tmp_path / 'board.kicad_pcb'
+    pcb.write_bytes(b' '*size)
+    t = Timings(str(tmp_path / 'timings.json'), logging.getLogger())
+    t.set_job(command, str(pcb))
+    return t
+
+
+def test_percentile():
+    """ Nearest rank, the samples don't need to be sorted """
+    assert percentile([5], 0.95) == 5
+    assert percentile(list(range(20, 0, -1)), 0.95) == 19
+    assert percentile(list(range(1, 101)), 0.95) == 95
+    assert percentile([3, 1, 2], 0.5) == 2
+
+
+def test_timeout_clamp(tmp_path):
+    t = new_timings(tmp_path)
+    # Not enough samples
+    for _ in range(timings.MIN_SAMPLES-1):
+        t.add('DRC', 1)
+    assert t.timeout('DRC', 300) == 300
+    # Fast phases use the minimum
+    t.add('DRC', 1)
+    assert t.timeout('DRC', 300) == timings.MIN_TIMEOUT
+    # The usual case
+    for _ in range(timings.MIN_SAMPLES):
+        t.add('fill', 20)
+    assert t.timeout('fill', 300) == 20*timings.FACTOR+timings.SLACK
+    # Slow phases are limited by the default
+    for _ in range(timings.MIN_SAMPLES):
+        t.add('slow', 1000)
+    assert t.timeout('slow', 300) == 300*timings.MAX_FACTOR
+    # Other phases aren't affected
+    assert t.timeout('start', 300) == 300
+
+
+def test_size_bucket(tmp_path):
+    """ The samples are shared by the inputs of similar size (same power of 2) """
+    assert new_timings(tmp_path, size=100).key == new_timings(tmp_path, size=127).key
+    assert new_timings(tmp_path, size=127).key != new_timings(tmp_path, size=128).key
+    assert new_timings(tmp_path, command='pcbnew export').key != new_timings(tmp_path).key
+    t = Timings(str(tmp_path / 'timings.json'), logging.getLogger())
+    t.set_job('pcbnew run_drc', str(tmp_path / 'missing.kicad_pcb'))
+    assert t.key == 'pcbnew run_drc|0|'
+
+
+def test_save_merge(tmp_path):
+    """ Two jobs saving to the same file, the last KEEP samples are kept """
+    t1 = new_timings(tmp_path)
+    t2 = new_timings(tmp_path)
+    t1.add('DRC', 1)
+    t2.add('DRC', 2)
+    t2.add('start', 3)
+    t1.save()
+    t2.save()
+    t3 = new_timings(tmp_path)
+    assert t3.phases[t3.key+'DRC'] == [1, 2]
+    assert t3.phases[t3.key+'start'] == [3]
+    # The saved samples are no longer pending
+    assert t1.new == {}
+    for n in range(timings.KEEP+10):
+        t3.add('DRC', n)
+    t3.save()
+    phases = new_timings(tmp_path).phases
+    assert phases[t3.key+'DRC'] == list(range(10, timings.KEEP+10))
+    assert not any(f.name.startswith('timings.json.') and f.name != 'timings.json.lock' for f in tmp_path.iterdir())
+
+
+def test_phase_nested():
+    """ An inner phase can't extend the outer deadline """
+    outer = Phase('write PDF', 10, now=0)
+    inner = Phase('dialog Print', 100, outer, now=0)
+    assert outer.end == 10
+    assert inner.end == 10
+    assert inner.limiting() is outer
+    # A shorter inner phase has its own deadline
+    short = Phase('dialog Save', 2, outer, now=0)
+    assert short.end == 2
+    assert short.limiting() is short
+    # Progress inside the inner phase is also progress for the outer, but using its own limit
+    inner.extend(5)
+    assert outer.end == 15
+    assert inner.end == 15
+
+
+def test_phase_steady_progress():
+    """ A long phase (i.e. a 12 layers DRC) doesn't time out while KiCad reports progress """
+    ph = Phase('DRC', 10, now=0)
+    assert ph.end == 10
+    for t in range(5, 1000, 5):
+        assert t < ph.end
+        ph.extend(t)
+    assert ph.end == 1005
+
+
+def test_phase_stalled():
+    """ Without progress the deadline doesn't move """
+    ph = Phase('DRC', 10, now=0)
+    ph.extend(3)
+    assert ph.end == 13
+    # Old activity can't reduce it
+    ph.extend(1)
+    assert ph.end == 13
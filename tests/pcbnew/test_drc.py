@@ -53,6 +53,37 @@ def test_drc_fail_1(test_dir):
     ctx.clean_up()
 
 
+@pytest.mark.skipif(os.environ.get('KIAUTO_INTERPOSER_DISABLE', '0') == '1', reason="Fail fast needs the interposer")
+def test_drc_fail_fast(test_dir):
+    """ Same as test_drc_fail_1, but KiCad is stopped after the report """
+    ctx = context.TestContext(test_dir, 'DRC_Error_Fail_Fast', 'fail-project')
+    cmd = [PROG, '-v', 'run_drc', '--fail_fast']
+    ctx.run(cmd, 254)
+    ctx.expect_out_file(REPORT)
+    m = ctx.search_err(OUT_REX)
+    assert m is not None
+    assert m.group(1) == '1'
+    assert m.group(2) == '1'
+    # No clean exit
+    assert ctx.search_err(r'DRC failed, stopping KiCad') is not None
+    ctx.clean_up()
+
+
+@pytest.mark.skipif(os.environ.get('KIAUTO_INTERPOSER_DISABLE', '0') == '1', reason="The ring needs the interposer")
+def test_drc_fail_ring(test_dir):
+    """ Same as test_drc_fail_1, but getting the events using shared memory """
+    ctx = context.TestContext(test_dir, 'DRC_Error_Ring', 'fail-project')
+    cmd = [PROG, '-vv', '--interposer_ring', 'run_drc']
+    ctx.run(cmd, 254)
+    ctx.expect_out_file(REPORT)
+    assert ctx.search_err(r'Using interposer ring') is not None
+    m = ctx.search_err(OUT_REX)
+    assert m is not None
+    assert m.group(1) == '1'
+    assert m.group(2) == '1'
+    ctx.clean_up()
+
+
 @pytest.mark.skipif(context.ki5, reason="Test for KiCad 6 exclusions")
 def test_drc_fail_exclusions(test_dir):
     ctx = context.TestContext(test_dir, 'DRC_Error_Exclusions', 'fail-project')
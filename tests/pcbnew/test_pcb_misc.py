@@ -11,6 +11,7 @@ pytest-3 --log-cli-level debug
 
 """
 
+import json
 import pytest
 import os
 import sys
@@ -116,3 +117,50 @@ def test_pad_error_1(test_dir):
     ctx.run(cmd)
     ctx.expect_out_file('good.cad')
     ctx.clean_up()
+
+
+@pytest.mark.skipif(os.environ.get('KIAUTO_INTERPOSER_DISABLE', '0') == '1', reason="The worker needs the interposer")
+def test_pcb_worker(test_dir):
+    """ Worker mode: many jobs using the same pcbnew """
+    ctx = context.TestContext(test_dir, 'PCB_Worker', 'good-project')
+    jobs = ctx.get_out_path('jobs.txt')
+    results = ctx.get_out_path('results.txt')
+    with open(jobs, 'wt') as f:
+        for job in (['ipc_netlist', '-o', 'w1.d356'], ['export_gencad', '-u', '-o', 'w2.cad'],
+                    ['export_gencad', '-o', 'w3.cad'], ['export', '-o', 'w4.pdf']):
+            f.write(json.dumps(job+[ctx.board_file, ctx.output_dir])+'\n')
+    cmd = [PROG, '-vv', 'worker', '-j', jobs, '-r', results]
+    ctx.run(cmd)
+    with open(results, 'rt') as f:
+        res = [json.loads(ln) for ln in f]
+    assert [r['status'] for r in res] == [0, 0, 0, WRONG_ARGUMENTS]
+    ctx.expect_out_file('w1.d356')
+    ctx.expect_out_file('w2.cad')
+    ctx.expect_out_file('w3.cad')
+    ctx.dont_expect_out_file('w4.pdf')
+    ctx.clean_up()
+
+
+def test_pcb_batch(test_dir):
+    """ Parallel batch runner """
+    ctx = context.TestContext(test_dir, 'PCB_Batch', 'good-project')
+    manifest = ctx.get_out_path('manifest.txt')
+    results = ctx.get_out_path('results.txt')
+    with open(manifest, 'wt') as f:
+        for opts in (['-o', 'b1.d356'], ['-o', 'b2.d356'], ['-o', 'b3.d356']):
+            f.write(json.dumps({'tool': PROG, 'action': 'ipc_netlist', 'file': ctx.board_file, 'output_dir': ctx.output_dir,
+                                'options': opts})+'\n')
+        f.write(json.dumps({'tool': PROG, 'action': 'ipc_netlist', 'file': BOGUS_PCB, 'output_dir': ctx.output_dir})+'\n')
+    cmd = ['kiauto_batch', '-vv', '-j', '2', '-r', results, '-d', ctx.get_out_path('batch')]
+    ctx.run(cmd, NO_PCB, filename=manifest, no_dir=True)
+    with open(results, 'rt') as f:
+        res = [json.loads(ln) for ln in f]
+    assert [r['status'] for r in res] == [0, 0, 0, NO_PCB]
+    # The jobs for the same file use the same worker, even when the other is idle
+    assert len({r['worker'] for r in res[:3]}) == 1
+    assert res[3]['worker'] != res[0]['worker']
+    assert not any(r['stolen'] for r in res)
+    ctx.expect_out_file('b1.d356')
+    ctx.expect_out_file('b2.d356')
+    ctx.expect_out_file('b3.d356')
+    ctx.clean_up()
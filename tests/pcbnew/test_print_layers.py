@@ -44,6 +44,24 @@ def test_print_pcb_good_dwg_1(test_dir):
     ctx.clean_up()
 
 
+def test_print_pcb_extra_output(test_dir):
+    """ Two extra outputs (SVG and PDF) printed using the same session """
+    ctx = context.TestContext(test_dir, 'Print_Extra_Output', 'good-project')
+    pdf = 'good_pcb_with_dwg.pdf'
+    pdf2 = 'extra_copy.pdf'
+    svg = 'extra_copy.svg'
+    cmd = [PROG, '-vv', 'export', '--output_name', pdf, '--extra_output', svg, '-e', pdf2]
+    layers = ['F.Cu', 'F.SilkS', 'Dwgs.User', 'Edge.Cuts']
+    ctx.run(cmd, extra=layers)
+    ctx.expect_out_file(pdf)
+    ctx.expect_out_file(svg)
+    ctx.expect_out_file(pdf2)
+    ctx.compare_image(pdf)
+    # The same layers, so the same result
+    ctx.compare_image(pdf2, pdf)
+    ctx.clean_up()
+
+
 def test_print_pcb_good_inner(test_dir):
     ctx = context.TestContext(test_dir, 'Print_Good_Inner', 'good-project')
     cmd = [PROG, '-r', '-vvv', 'export']
@@ -0,0 +1,300 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+# Copyright (c) 2022 Salvador E. Tropea
+# Copyright (c) 2022 Instituto Nacional de Tecnologïa Industrial
+# License: Apache 2.0
+# Project: KiAuto (formerly kicad-automation-scripts)
+"""
+Replays the interposer dialogs captured in interposer/logs/*.log (see tools/filter_interposer.pl) to measure the
+overhead of our side of the dialog, no KiCad involved.
+The events are sent to the queue using the original timing, the waits found in the log are done using wait_queue and
+the "KiCad sleeping" points using wait_kicad_ready_i. The overhead is the time from the moment the matching event is
+available to the moment the wait returns.
+Note: most of the overhead comes from the 0.1 s poll of the KiCad status in wait_kicad_ready_i, the logs don't have
+the idle events. So each phase waiting for KiCad sleeping (i.e. "file creation") adds about 100 ms, use -p to see it.
+"""
+import argparse
+import ast
+import json
+import logging
+import os
+from queue import Queue
+import re
+import sys
+from threading import Thread, Condition
+import time
+
+# Look for the 'kiauto' module from where the script is running
+script_dir = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.dirname(script_dir))
+import psutil
+from kiauto import interposer
+
+EVENT_RE = re.compile(r'>>Interposer<<:(.*) \(@([\d.]+) D [\d.-]+\)')
+MATCH_RE = re.compile(r'Interposer match: (.*?) \(\S+ - interposer.py:\d+\)$')
+WAIT_RE = re.compile(r'Waiting for `(\[.*\])` starts=(True|False) times=(\d+)')
+PHASE_RE = re.compile(r'^\d+ INFO:(.*)')
+READY_RE = re.compile(r'= KiCad (finally|already) (sleeping|idle)')
+# Regression threshold for --compare (%)
+THRESHOLD = 20
+
+
+class Trace(object):
+    def __init__(self, fname):
+        """ Events: [(time_ms, line)], ops: [(phase, kind, args, events_before)] """
+        self.name = os.path.splitext(os.path.basename(fname))[0]
+        self.events = []
+        self.ops = []
+        self.phases = ['start']
+        pending = None
+        self.last_tm = 0.0
+        last_logged = None
+        with open(fname, 'rt') as f:
+            for ln in f:
+                ln = ln.rstrip('\n')
+                m = PHASE_RE.match(ln)
+                if m:
+                    pending = self.close_wait(pending)
+                    self.phases.append(m.group(1).strip())
+                    continue
+                m = EVENT_RE.search(ln)
+                if m:
+                    self.last_tm = float(m.group(2))
+                    last_logged = m.group(1)
+                    self.events.append((self.last_tm, last_logged))
+                    continue
+                m = WAIT_RE.search(ln)
+                if m:
+                    self.close_wait(pending)
+                    pending = (ast.literal_eval(m.group(1)), m.group(2) == 'True', int(m.group(3)))
+                    self.ops.append((len(self.phases)-1, 'wait', pending, len(self.events)))
+                    continue
+                m = MATCH_RE.search(ln)
+                if m:
+                    line = m.group(1)
+                    if line != last_logged:
+                        # The filtered log doesn't have this event, the match shows it was there
+                        self.events.append((self.last_tm, line))
+                        # The wait must be done after the event
+                        if pending is not None:
+                            p, kind, args, _ = self.ops[-1]
+                            self.ops[-1] = (p, kind, args, len(self.events))
+                    last_logged = None
+                    if pending is None:
+                        # Not logged wait (i.e. PANGO)
+                        self.ops.append((len(self.phases)-1, 'wait', ([line], False, 1), len(self.events)))
+                    pending = None
+                    continue
+                if READY_RE.search(ln):
+                    pending = self.close_wait(pending)
+                    self.ops.append((len(self.phases)-1, 'ready', None, len(self.events)))
+        self.close_wait(pending)
+
+    def close_wait(self, pending):
+        """ Old logs don't have the matches, add the events needed by a wait that finished """
+        if pending is None:
+            return None
+        strs, starts, times = pending
+        for _, line in self.events[self.ops[-1][3]:]:
+            if any(line.startswith(s) if starts else line == s for s in strs):
+                times -= 1
+        for _ in range(times):
+            self.events.append((self.last_tm, strs[0]))
+        return None
+
+
+class ReplayQueue(Queue):
+    """ Keeps track of the events consumed and when they were available.
+        The events after a wait are a consequence of our actions, so they aren't sent until we reach the wait
+        (the horizon) """
+    def __init__(self):
+        super().__init__()
+        self.avail = []
+        self.consumed = 0
+        self.horizon = 0
+        self.gate = Condition()
+
+    def set_horizon(self, horizon):
+        with self.gate:
+            self.horizon = horizon
+            self.gate.notify()
+
+    def wait_horizon(self, n):
+        with self.gate:
+            while self.horizon <= n:
+                self.gate.wait()
+
+    def put_event(self, tm, line):
+        self.avail.append(time.perf_counter())
+        self.put((tm/1000, line+'\n'))
+
+    def get(self, block=True, timeout=None):
+        item = super().get(block, timeout)
+        self.consumed += 1
+        return item
+
+
+class ReplayProcess(object):
+    """ Emulates the KiCad process status and exit """
+    def __init__(self, q):
+        self.q = q
+        self.sleep_at = 0
+        self.finished = False
+
+    def status(self):
+        return psutil.STATUS_SLEEPING if len(self.q.avail) >= self.sleep_at else psutil.STATUS_RUNNING
+
+    def poll(self):
+        return 0 if self.finished and self.q.empty() else None
+
+
+def feed(q, proc, events, speed):
+    """ Send the events keeping the time between them """
+    last = time.perf_counter()
+    last_tm = 0
+    for n, (tm, line) in enumerate(events):
+        q.wait_horizon(n)
+        if speed:
+            delay = last+(tm-last_tm)/1000/speed-time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+        last = time.perf_counter()
+        last_tm = tm
+        q.put_event(tm, line)
+    proc.finished = True
+
+
+def make_cfg(logger, q, proc):
+    cfg = argparse.Namespace()
+    cfg.use_interposer = cfg.enable_interposer = True
+    cfg.logger = logger
+    cfg.verbose = 0
+    cfg.time_out_scale = 1.0
+    cfg.kicad_q = q
+    cfg.popen_obj = cfg.kicad_process = proc
+    cfg.ki5 = False
+    cfg.window_title_end = ' Editor'
+    cfg.auto_dialogs = set()
+    cfg.auto_dialogs_prefixes = ()
+    cfg.collecting_io = False
+    cfg.last_msg_time = 0
+    cfg.interposer_dialog = interposer.InterposerDialog(None)
+    cfg.idle_events = cfg.kicad_idle = False
+    cfg.frames = []
+    cfg.render_settled = False
+    cfg.settled_frame = cfg.captured_frame = -1
+    cfg.settle_time = 0
+    return cfg
+
+
+def replay(trace, logger, speed):
+    q = ReplayQueue()
+    proc = ReplayProcess(q)
+    cfg = make_cfg(logger, q, proc)
+    phases = {}
+    feeder = Thread(target=feed, args=(q, proc, trace.events, speed), daemon=True)
+    start = time.perf_counter()
+    feeder.start()
+    for n, (phase, kind, args, needed) in enumerate(trace.ops):
+        # The events up to the next operation are the consequence of this one
+        q.set_horizon(trace.ops[n+1][3] if n+1 < len(trace.ops) else len(trace.events))
+        op_start = time.perf_counter()
+        stats = phases.setdefault(trace.phases[phase], {'ops': 0, 'overhead': 0.0, 'max': 0.0, 'failed': 0})
+        stats['ops'] += 1
+        if kind == 'wait':
+            strs, starts, times = args
+            # We replay the matching, the dialogs are already handled in the trace
+            res = interposer.wait_queue(cfg, strs, starts=starts, times=times, with_windows=True, kicad_can_exit=True)
+        else:
+            proc.sleep_at = needed
+            res = interposer.wait_kicad_ready_i(cfg, kicad_can_exit=True)
+        if res == interposer.KICAD_EXIT_MSG:
+            # All the events were consumed and we didn't get a match
+            stats['failed'] += 1
+            continue
+        # The last event we needed was available at this moment
+        ref = needed if kind == 'ready' else q.consumed
+        if ref:
+            while len(q.avail) < ref:
+                time.sleep(0.001)
+            # When replaying at full speed the events are there before we start
+            overhead = max(0.0, time.perf_counter()-max(q.avail[ref-1], op_start))*1000
+            stats['overhead'] += overhead
+            stats['max'] = max(stats['max'], overhead)
+    elapsed = (time.perf_counter()-start)*1000
+    feeder.join()
+    total = sum(s['overhead'] for s in phases.values())
+    return {'trace': trace.name, 'events': len(trace.events), 'ops': len(trace.ops),
+            'duration': trace.events[-1][0] if trace.events else 0, 'elapsed': round(elapsed, 3),
+            'overhead': round(total, 3), 'failed': sum(s['failed'] for s in phases.values()),
+            'phases': {k: {'ops': v['ops'], 'overhead': round(v['overhead'], 3), 'max': round(v['max'], 3),
+                           'failed': v['failed']} for k, v in phases.items()}}
+
+
+def compare(results, baseline, threshold, logger):
+    """ Returns the number of regressions """
+    base = {r['trace']: r for r in baseline}
+    errors = 0
+    for r in results:
+        b = base.get(r['trace'])
+        if b is None:
+            logger.warning('{}: not in the baseline'.format(r['trace']))
+            continue
+        if r['failed'] > b['failed']:
+            logger.error('{}: {} failed waits (baseline {})'.format(r['trace'], r['failed'], b['failed']))
+            errors += 1
+        # Small values are just noise
+        limit = max(b['overhead']*(1+threshold/100), b['overhead']+5)
+        if r['overhead'] > limit:
+            logger.error('{}: overhead {:.1f} ms (baseline {:.1f} ms)'.format(r['trace'], r['overhead'], b['overhead']))
+            errors += 1
+    return errors
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Replay the interposer logs to measure our overhead')
+    parser.add_argument('logs', nargs='*', help='Logs to replay [interposer/logs/*.log]')
+    parser.add_argument('--speed', '-s', type=float, default=1.0,
+                        help='Replay speed, 0 is as fast as possible [1.0]')
+    parser.add_argument('--repeat', '-n', type=int, default=1, help='Replay each log N times, the best is used [1]')
+    parser.add_argument('--phases', '-p', action='store_true', help='Show the overhead of each phase')
+    parser.add_argument('--save', nargs=1, help='Save the results as a baseline')
+    parser.add_argument('--compare', '-c', nargs=1, help='Compare against a baseline')
+    parser.add_argument('--threshold', '-t', type=float, default=THRESHOLD,
+                        help='Overhead increase considered a regression (%%) ['+str(THRESHOLD)+']')
+    parser.add_argument('--verbose', '-v', action='count', default=0)
+    args = parser.parse_args()
+    logging.basicConfig(format='%(levelname)s:%(message)s', level=logging.DEBUG if args.verbose > 1 else logging.INFO)
+    logger = logging.getLogger('replay')
+    # The matching is logged at debug level
+    interposer_logger = logging.getLogger('kiauto.replay')
+    interposer_logger.setLevel(logging.DEBUG if args.verbose else logging.WARNING)
+    logs = args.logs
+    if not logs:
+        log_dir = os.path.join(os.path.dirname(script_dir), 'interposer', 'logs')
+        logs = sorted(os.path.join(log_dir, f) for f in os.listdir(log_dir) if f.endswith('.log'))
+    results = []
+    for fname in logs:
+        trace = Trace(fname)
+        best = None
+        for _ in range(max(args.repeat, 1)):
+            r = replay(trace, interposer_logger, args.speed)
+            if best is None or r['overhead'] < best['overhead']:
+                best = r
+        results.append(best)
+        logger.info('{:24} {:4} events {:4} waits {:9.1f} ms trace {:9.1f} ms replay {:8.2f} ms overhead {}'.
+                    format(best['trace'], best['events'], best['ops'], best['duration'], best['elapsed'], best['overhead'],
+                           '({} failed)'.format(best['failed']) if best['failed'] else ''))
+        if args.phases:
+            for name, s in best['phases'].items():
+                logger.info('    {:60.60} {:3} waits {:8.2f} ms (max {:.2f})'.format(name, s['ops'], s['overhead'], s['max']))
+    logger.info('Total overhead {:.2f} ms'.format(sum(r['overhead'] for r in results)))
+    if args.save:
+        with open(args.save[0], 'wt') as f:
+            json.dump(results, f, indent=1)
+    if args.compare:
+        with open(args.compare[0], 'rt') as f:
+            errors = compare(results, json.load(f), args.threshold, logger)
+        if errors:
+            sys.exit(1)
+        logger.info('No regressions')